@@ -0,0 +1,406 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <exception>
+#include <cstddef>
+#include <sstream>
+#include <memory>
+#include <algorithm>
+
+#include "cxxargs.hpp"
+#include "bm64.h"
+#include "pack.hpp"
+
+#include "telescope.hpp"
+
+namespace telescope {
+namespace bench {
+struct Result {
+  std::string name;
+  double seconds;
+  size_t n_reads;
+  size_t n_bytes;      // Bytes read or written, 0 if not applicable
+  size_t n_ecs;        // 0 if not applicable
+  size_t output_bytes; // Size of the output, 0 if not applicable
+  size_t peak_rss_kb;
+};
+
+class Timer {
+  // Measures the time and peak memory use from construction to stop().
+  // The peak memory includes the inputs that are already in memory.
+private:
+  std::chrono::time_point<std::chrono::steady_clock> start;
+
+public:
+  Timer() {
+    Metrics::ResetPeakRSS();
+    this->start = std::chrono::steady_clock::now();
+  }
+
+  Result stop(const std::string &name, const size_t n_reads, const size_t n_bytes = 0, const size_t n_ecs = 0, const size_t output_bytes = 0) const {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - this->start;
+    return Result{ name, elapsed.count(), n_reads, n_bytes, n_ecs, output_bytes, Metrics::ReadStatus("VmHWM") };
+  }
+};
+
+void Report(const Result &res, const bool json) {
+  // Print `res` as a row in a tab-separated table (NA marks values that
+  // do not apply) or as a JSON object without those values.
+  double reads_per_second = res.n_reads/res.seconds;
+  double mb_per_second = res.n_bytes/res.seconds/1000000.0;
+  if (json) {
+    std::cout << "{\"benchmark\": \"" << res.name << "\", \"seconds\": " << res.seconds << ", \"reads_per_second\": " << reads_per_second;
+    if (res.n_bytes > 0) {
+      std::cout << ", \"MB_per_second\": " << mb_per_second;
+    }
+    if (res.n_ecs > 0) {
+      std::cout << ", \"n_ecs\": " << res.n_ecs;
+    }
+    if (res.output_bytes > 0) {
+      std::cout << ", \"output_bytes\": " << res.output_bytes;
+    }
+    std::cout << ", \"peak_rss_kb\": " << res.peak_rss_kb << "}" << '\n';
+  } else {
+    std::cout << res.name << '\t' << res.seconds << '\t' << reads_per_second << '\t';
+    std::cout << (res.n_bytes > 0 ? std::to_string(mb_per_second) : "NA") << '\t';
+    std::cout << (res.n_ecs > 0 ? std::to_string(res.n_ecs) : "NA") << '\t';
+    std::cout << (res.output_bytes > 0 ? std::to_string(res.output_bytes) : "NA") << '\t';
+    std::cout << res.peak_rss_kb << '\n';
+  }
+  std::cout.flush();
+}
+
+struct GeneratorOptions {
+  size_t n_reads;
+  size_t n_refs;
+  size_t n_patterns;  // Number of distinct multi-target patterns
+  size_t max_hits;    // Patterns have 1...max_hits targets
+  double p_unaligned; // Probability that a read does not align
+  double p_unique;    // Probability that a read aligns against one random target
+  double concordance; // Probability that the mate aligns against the same targets
+  uint32_t seed;
+};
+
+void RandomPairedAlignment(const GeneratorOptions &opts, bm::bvector<> *strand_1, bm::bvector<> *strand_2) {
+  // Generate the alignments of paired reads where the aligned reads hit
+  // either one random target or one of `n_patterns` random patterns of
+  // 1...max_hits targets. With probability `concordance` the mate has
+  // the same targets and otherwise its targets are drawn independently.
+  std::mt19937_64 gen(opts.seed);
+  std::uniform_int_distribution<size_t> target(0, opts.n_refs - 1);
+  std::uniform_int_distribution<size_t> pattern(0, opts.n_patterns - 1);
+  std::uniform_int_distribution<size_t> pattern_size(1, opts.max_hits);
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+
+  std::vector<std::vector<size_t>> patterns(opts.n_patterns);
+  for (size_t i = 0; i < opts.n_patterns; ++i) {
+    size_t size = pattern_size(gen);
+    for (size_t j = 0; j < size; ++j) {
+      patterns[i].emplace_back(target(gen));
+    }
+  }
+
+  auto draw_hits = [&](std::vector<size_t> *hits) {
+    hits->clear();
+    double draw = unif(gen);
+    if (draw < opts.p_unaligned) {
+      return; // Unaligned
+    } else if (draw < opts.p_unaligned + opts.p_unique) {
+      hits->emplace_back(target(gen));
+    } else {
+      *hits = patterns[pattern(gen)];
+    }
+  };
+
+  strand_1->set_new_blocks_strat(bm::BM_GAP);
+  strand_2->set_new_blocks_strat(bm::BM_GAP);
+  bm::bvector<>::bulk_insert_iterator it_1(*strand_1);
+  bm::bvector<>::bulk_insert_iterator it_2(*strand_2);
+  std::vector<size_t> hits;
+  for (size_t i = 0; i < opts.n_reads; ++i) {
+    draw_hits(&hits);
+    for (size_t j = 0; j < hits.size(); ++j) {
+      it_1 = i*opts.n_refs + hits[j];
+    }
+    if (unif(gen) >= opts.concordance) {
+      draw_hits(&hits);
+    }
+    for (size_t j = 0; j < hits.size(); ++j) {
+      it_2 = i*opts.n_refs + hits[j];
+    }
+  }
+  it_1.flush();
+  it_2.flush();
+  strand_1->optimize();
+  strand_2->optimize();
+}
+
+std::string ToPlaintext(const bm::bvector<> &ec_configs, const size_t n_reads, const size_t n_refs) {
+  // Format the alignment in the plaintext Themisto format.
+  bm::bvector<> copy(ec_configs);
+  ThemistoAlignment aln(n_refs, n_reads, copy);
+  std::ostringstream out;
+  write::ThemistoPlaintext(aln, &out);
+  return out.str();
+}
+
+std::string ToCompact(const bm::bvector<> &ec_configs, const size_t n_reads, const size_t n_refs) {
+  // Format the alignment in the alignment-writer format.
+  std::ostringstream out;
+  alignment_writer::Pack(ec_configs, n_refs, n_reads, &out);
+  return out.str();
+}
+
+Result Parse(const std::string &text, const size_t n_refs, const std::string &name) {
+  std::istringstream stream(text);
+  std::vector<std::istream*> streams = { &stream };
+  bm::bvector<> ec_configs(bm::BM_GAP);
+
+  Timer timer;
+  size_t n_reads = ReadPairedAlignments(bm::set_AND, n_refs, streams, &ec_configs);
+  return timer.stop(name, n_reads, text.size());
+}
+
+Result ReadPaired(const std::string &strand_1, const std::string &strand_2, const size_t n_refs, const size_t n_threads, const std::string &name) {
+  // Intersection of the alignments in `strand_1` and `strand_2`.
+  std::istringstream stream_1(strand_1);
+  std::istringstream stream_2(strand_2);
+  std::vector<std::istream*> streams = { &stream_1, &stream_2 };
+  bm::bvector<> ec_configs(bm::BM_GAP);
+
+  Timer timer;
+  size_t n_reads = ReadPairedAlignments(bm::set_AND, n_refs, streams, &ec_configs, n_threads);
+  return timer.stop(name, n_reads, strand_1.size() + strand_2.size());
+}
+
+Result Concatenate(const std::string &lane_1, const std::string &lane_2, const size_t n_refs, const size_t n_threads, const std::string &name) {
+  // Concatenation of the alignments in `lane_1` and `lane_2`.
+  std::istringstream stream_1(lane_1);
+  std::istringstream stream_2(lane_2);
+  std::vector<std::istream*> streams = { &stream_1, &stream_2 };
+  bm::bvector<> ec_configs(bm::BM_GAP);
+
+  Timer timer;
+  size_t n_reads = ConcatenateAlignmentFiles(n_refs, streams, &ec_configs, n_threads);
+  return timer.stop(name, n_reads, lane_1.size() + lane_2.size());
+}
+
+Result CollapseStream(const std::string &strand_1, const std::string &strand_2, const size_t n_refs, const size_t n_threads, const std::string &name) {
+  // Includes the time to read and intersect `strand_1` and `strand_2`
+  // since collapse_stream collapses the reads as they are read.
+  std::istringstream stream_1(strand_1);
+  std::istringstream stream_2(strand_2);
+  std::vector<std::istream*> streams = { &stream_1, &stream_2 };
+
+  Timer timer;
+  const ThemistoAlignment &aln = read::Themisto(bm::set_AND, n_refs, streams, collapse_stream, n_threads);
+  return timer.stop(name, aln.n_reads(), strand_1.size() + strand_2.size(), aln.n_ecs());
+}
+
+Result Collapse(const bm::bvector<> &ec_configs, const size_t n_reads, const size_t n_refs, const collapse_engine engine, const size_t n_threads, const std::string &name) {
+  bm::bvector<> copy(ec_configs);
+  ThemistoAlignment aln(n_refs, n_reads, copy);
+
+  Timer timer;
+  aln.collapse(engine, n_threads);
+  return timer.stop(name, n_reads, 0, aln.n_ecs());
+}
+
+Result CollapseRows(const bm::bvector<> &ec_configs, const size_t n_reads, const size_t n_refs, const size_t n_threads, const std::string &name) {
+  // Includes the time to build the row index from the bit matrix.
+  ThemistoAlignment aln(n_refs);
+
+  Timer timer;
+  const RowIndex &rows = RowIndex(ec_configs, n_refs, n_reads);
+  aln.collapse(rows, n_threads);
+  return timer.stop(name, n_reads, 0, aln.n_ecs());
+}
+
+std::vector<uint32_t> RandomGroups(const size_t n_refs, const size_t n_groups, const uint32_t seed) {
+  // Every group gets at least one target if n_refs >= n_groups since
+  // read::ThemistoGrouped expects the group ids to be 0...n_groups - 1.
+  std::mt19937_64 gen(seed);
+  std::vector<uint32_t> group_indicators(n_refs);
+  for (size_t i = 0; i < n_refs; ++i) {
+    group_indicators[i] = i % n_groups;
+  }
+  std::shuffle(group_indicators.begin(), group_indicators.end(), gen);
+  return group_indicators;
+}
+
+Result CollapseGrouped(const bm::bvector<> &ec_configs, const size_t n_reads, const size_t n_refs, const std::vector<uint32_t> &group_indicators, const size_t n_groups, const bool collapse_on_groups, const std::string &name) {
+  // Output size is the memory used by the group counts.
+  bm::bvector<> copy(ec_configs);
+  GroupedAlignment<uint32_t, uint32_t> aln(n_refs, n_groups, n_reads, group_indicators, collapse_on_groups);
+
+  Timer timer;
+  aln.collapse(copy, collapse_hash, 1);
+  Result res = timer.stop(name, n_reads, 0, aln.n_ecs());
+
+  bm::sparse_vector<uint32_t, bm::bvector<>>::statistics st;
+  aln.get_sparse_group_counts().calc_stat(&st);
+  res.output_bytes = st.memory_used;
+  return res;
+}
+
+Result ReadGrouped(const std::string &strand_1, const std::string &strand_2, const size_t n_refs, const std::vector<uint32_t> &group_indicators, const size_t n_threads, const std::string &name) {
+  std::istringstream stream_1(strand_1);
+  std::istringstream stream_2(strand_2);
+  std::vector<std::istream*> streams = { &stream_1, &stream_2 };
+  std::unique_ptr<Alignment> aln;
+
+  Timer timer;
+  read::ThemistoGrouped<uint32_t>(bm::set_AND, n_refs, group_indicators, streams, aln, collapse_hash, n_threads);
+  return timer.stop(name, aln->n_reads(), strand_1.size() + strand_2.size(), aln->n_ecs());
+}
+
+template <typename F>
+Result Write(const ThemistoAlignment &aln, F write_function, const std::string &name) {
+  // Time `write_function(&out)` writing into memory.
+  std::ostringstream out;
+  Timer timer;
+  write_function(&out);
+  size_t n_bytes = out.tellp();
+  return timer.stop(name, aln.n_reads(), n_bytes, aln.n_ecs(), n_bytes);
+}
+}
+}
+
+int main(int argc, char* argv[]) {
+  cxxargs::Arguments args("telescope_bench", "Usage: telescope_bench --n-reads <number of reads> --n-refs <number of targets>");
+  args.add_long_argument<size_t>("n-reads", "Number of reads in the synthetic alignment (default: 1000000).", 1000000);
+  args.add_long_argument<size_t>("n-refs", "Number of targets in the synthetic alignment (default: 1000).", 1000);
+  args.add_long_argument<size_t>("n-patterns", "Number of distinct multi-target patterns (default: 10000).", 10000);
+  args.add_long_argument<size_t>("max-hits", "Maximum number of targets in a multi-target pattern (default: 5).", 5);
+  args.add_long_argument<double>("p-unaligned", "Probability that a read does not align (default: 0.2).", 0.2);
+  args.add_long_argument<double>("p-unique", "Probability that a read aligns against a single random target (default: 0.4).", 0.4);
+  args.add_long_argument<double>("concordance", "Probability that both reads in a pair align against the same targets (default: 0.9).", 0.9);
+  args.add_long_argument<size_t>("n-groups", "Number of reference groups in the grouped benchmarks (default: 100).", 100);
+  args.add_long_argument<size_t>("threads", "Number of threads for the parallel benchmarks (default: 1).", 1);
+  args.add_long_argument<uint32_t>("seed", "Seed for the random number generator (default: 26012023).", 26012023);
+  args.add_long_argument<bool>("skip-legacy", "Skip the legacy collapse engine, which is slow with many targets (default: false).", false);
+  args.add_long_argument<bool>("json", "Print one JSON object per benchmark instead of a table (default: false).", false);
+  try {
+    args.parse(argc, argv);
+  } catch (std::exception &e) {
+    std::cerr << "Parsing arguments failed:\n\t" << e.what() << '\n' << args.help() << '\n';
+    return 1;
+  }
+
+  telescope::bench::GeneratorOptions opts;
+  opts.n_reads = args.value<size_t>("n-reads");
+  opts.n_refs = args.value<size_t>("n-refs");
+  opts.n_patterns = args.value<size_t>("n-patterns");
+  opts.max_hits = args.value<size_t>("max-hits");
+  opts.p_unaligned = args.value<double>("p-unaligned");
+  opts.p_unique = args.value<double>("p-unique");
+  opts.concordance = args.value<double>("concordance");
+  opts.seed = args.value<uint32_t>("seed");
+  size_t n_reads = opts.n_reads;
+  size_t n_refs = opts.n_refs;
+  size_t n_threads = args.value<size_t>("threads");
+  size_t n_groups = args.value<size_t>("n-groups");
+  bool skip_legacy = args.value<bool>("skip-legacy");
+  bool json = args.value<bool>("json");
+
+  bm::bvector<> strand_1;
+  bm::bvector<> strand_2;
+  telescope::bench::RandomPairedAlignment(opts, &strand_1, &strand_2);
+  const std::string &text_1 = telescope::bench::ToPlaintext(strand_1, n_reads, n_refs);
+  const std::string &text_2 = telescope::bench::ToPlaintext(strand_2, n_reads, n_refs);
+  const std::string &compact_1 = telescope::bench::ToCompact(strand_1, n_reads, n_refs);
+  const std::string &compact_2 = telescope::bench::ToCompact(strand_2, n_reads, n_refs);
+
+  // The collapse and write benchmarks use the intersection of the strands.
+  bm::bvector<> ec_configs(strand_1);
+  ec_configs &= strand_2;
+  ec_configs.optimize();
+
+  auto report = [json](const telescope::bench::Result &res) { telescope::bench::Report(res, json); };
+  std::string threads_suffix = "_" + std::to_string(n_threads) + "_threads";
+  if (!json) {
+    std::cout << "benchmark" << '\t' << "seconds" << '\t' << "reads_per_second" << '\t' << "MB_per_second" << '\t' << "n_ecs" << '\t' << "output_bytes" << '\t' << "peak_rss_kb" << '\n';
+  }
+
+  // Reading
+  report(telescope::bench::Parse(text_1, n_refs, "parse_plaintext"));
+  report(telescope::bench::ReadPaired(text_1, text_2, n_refs, 1, "read_paired_plaintext"));
+  report(telescope::bench::ReadPaired(compact_1, compact_2, n_refs, 1, "read_paired_compact"));
+  report(telescope::bench::ReadPaired(text_1, compact_2, n_refs, 1, "read_paired_mixed"));
+  if (n_threads > 1) {
+    report(telescope::bench::ReadPaired(text_1, text_2, n_refs, n_threads, "read_paired_plaintext" + threads_suffix));
+    report(telescope::bench::ReadPaired(compact_1, compact_2, n_refs, n_threads, "read_paired_compact" + threads_suffix));
+  }
+  report(telescope::bench::Concatenate(text_1, text_2, n_refs, 1, "concatenate_plaintext"));
+  report(telescope::bench::Concatenate(compact_1, compact_2, n_refs, 1, "concatenate_compact"));
+  if (n_threads > 1) {
+    report(telescope::bench::Concatenate(text_1, text_2, n_refs, n_threads, "concatenate_plaintext" + threads_suffix));
+    report(telescope::bench::Concatenate(compact_1, compact_2, n_refs, n_threads, "concatenate_compact" + threads_suffix));
+  }
+
+  // Collapsing
+  if (!skip_legacy) {
+    report(telescope::bench::Collapse(ec_configs, n_reads, n_refs, telescope::collapse_legacy, 1, "collapse_legacy"));
+  }
+  report(telescope::bench::Collapse(ec_configs, n_reads, n_refs, telescope::collapse_hash, 1, "collapse_hash"));
+  report(telescope::bench::Collapse(ec_configs, n_reads, n_refs, telescope::collapse_sort, 1, "collapse_sort"));
+  report(telescope::bench::CollapseRows(ec_configs, n_reads, n_refs, 1, "collapse_rows"));
+  report(telescope::bench::CollapseStream(text_1, text_2, n_refs, 1, "collapse_stream_plaintext"));
+  report(telescope::bench::CollapseStream(compact_1, compact_2, n_refs, 1, "collapse_stream_compact"));
+  if (n_threads > 1) {
+    report(telescope::bench::Collapse(ec_configs, n_reads, n_refs, telescope::collapse_hash, n_threads, "collapse_hash" + threads_suffix));
+    report(telescope::bench::Collapse(ec_configs, n_reads, n_refs, telescope::collapse_sort, n_threads, "collapse_sort" + threads_suffix));
+    report(telescope::bench::CollapseRows(ec_configs, n_reads, n_refs, n_threads, "collapse_rows" + threads_suffix));
+    report(telescope::bench::CollapseStream(text_1, text_2, n_refs, n_threads, "collapse_stream_plaintext" + threads_suffix));
+    report(telescope::bench::CollapseStream(compact_1, compact_2, n_refs, n_threads, "collapse_stream_compact" + threads_suffix));
+  }
+
+  // Grouped alignments
+  const std::vector<uint32_t> &group_indicators = telescope::bench::RandomGroups(n_refs, n_groups, opts.seed);
+  report(telescope::bench::CollapseGrouped(ec_configs, n_reads, n_refs, group_indicators, n_groups, false, "collapse_grouped_targets"));
+  report(telescope::bench::CollapseGrouped(ec_configs, n_reads, n_refs, group_indicators, n_groups, true, "collapse_grouped_counts"));
+  report(telescope::bench::ReadGrouped(text_1, text_2, n_refs, group_indicators, n_threads, "read_grouped"));
+
+  // Writing
+  bm::bvector<> plain_configs(ec_configs);
+  const telescope::ThemistoAlignment plain(n_refs, n_reads, plain_configs);
+  bm::bvector<> collapsed_configs(ec_configs);
+  telescope::ThemistoAlignment collapsed(n_refs, n_reads, collapsed_configs);
+  collapsed.collapse(telescope::collapse_hash, n_threads);
+
+  report(telescope::bench::Write(plain, [&](std::ostream *out) { telescope::write::ThemistoPlaintext(plain, out, 1); }, "write_plaintext"));
+  if (n_threads > 1) {
+    report(telescope::bench::Write(plain, [&](std::ostream *out) { telescope::write::ThemistoPlaintext(plain, out, n_threads); }, "write_plaintext" + threads_suffix));
+  }
+  report(telescope::bench::Write(plain, [&](std::ostream *out) { alignment_writer::Pack(plain.get_configs(), n_refs, n_reads, out); }, "write_compact"));
+  report(telescope::bench::Write(collapsed, [&](std::ostream *out) {
+    // Only the size of the equivalence class file is reported.
+    std::ostringstream tsv_file;
+    telescope::write::ThemistoToKallisto(collapsed, out, &tsv_file);
+  }, "write_kallisto"));
+  report(telescope::bench::Write(collapsed, [&](std::ostream *out) { telescope::write::ThemistoReadAssignments(collapsed, out); }, "write_read_assignments"));
+  report(telescope::bench::Write(collapsed, [&](std::ostream *out) { telescope::write::ECIndexFile(collapsed, out); }, "write_ec_index"));
+  report(telescope::bench::Write(collapsed, [&](std::ostream *out) { telescope::write::KallistoInfoFile(telescope::KallistoRunInfo(collapsed), 4, out); }, "write_run_info"));
+
+  return 0;
+}
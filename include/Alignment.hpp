@@ -22,53 +22,81 @@
 #include <cstddef>
 #include <vector>
 #include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <memory>
 
 #include "bm64.h"
 #include "bmsparsevec.h"
 
+#include "ECConsumer.hpp"
+#include "ECTable.hpp"
+#include "Metrics.hpp"
+#include "RadixSort.hpp"
+#include "RowReader.hpp"
+#include "RowIndex.hpp"
+
 namespace telescope {
+// Algorithms for collapsing an alignment into equivalence classes.
+//   `collapse_hash`: enumerate the set bits of each read and hash the
+//                    sorted target ids in an open-addressing table (default).
+//   `collapse_legacy`: copy each read into a std::vector<bool> and
+//                      hash it with std::unordered_map.
+//   `collapse_stream`: collapse each read as it is read from the input
+//                      without storing the full alignment (see RowReader).
+//                      Same as `collapse_hash` for an alignment that is
+//                      already in memory.
+//   `collapse_sort`: radix sort the reads by a signature of their targets
+//                    and assign the classes in one pass over the sorted
+//                    reads. Gives the same equivalence classes and ids as
+//                    `collapse_hash` with memory use that only depends on
+//                    the number of aligned reads and targets.
+enum collapse_engine { collapse_hash, collapse_legacy, collapse_stream, collapse_sort };
+
+// View into the IDs of the reads assigned to an equivalence class.
+typedef IdRange ReadIds;
+
 class Alignment {
 private:
   // Insert a pseudoalignment into the equivalence class format (varies by alignment type, implement in children).
-  // Used by the public collapse() method to create the equivalence classes.
-  virtual void insert(const std::vector<bool> &current_ec, const size_t &i, size_t *ec_id, std::unordered_map<std::vector<bool>, uint32_t> *ec_to_pos, bm::bvector<>::bulk_insert_iterator *bv_it) =0;
-
-protected:
-  // Number of reads in the alignment
-  uint32_t n_processed;
-
-  // Number of alignment targets
-  size_t n_refs;
-
-  // Number of times an alignment corresponding to each equivalence class was observed
-  std::vector<uint32_t> ec_counts;
-
-  // IDs of reads that are assigned to each equivalence class
-  std::vector<std::vector<uint32_t>> aligned_reads;
-
-public:
-  // Collapse the argument alignment into equivalence classes and their observation counts.
-  // Assumes that the internal variables `n_refs` and `n_processed` are the same as in the argument.
-  // The logic for creating the equivalence classes must be implemented in the insert() method in
-  // each realization of the base class.
-  void collapse(bm::bvector<> &ec_configs) {
-    bm::bvector<> compressed_ec_configs;
-    compressed_ec_configs.set_new_blocks_strat(bm::BM_GAP); // Store data in compressed format.
-    bm::bvector<>::bulk_insert_iterator bv_it(compressed_ec_configs);
-
+  // Used by the public collapse() method to create the equivalence classes with `collapse_legacy`.
+  virtual void insert(const std::vector<bool> &current_ec, const size_t &i, size_t *ec_id, std::unordered_map<std::vector<bool>, uint32_t> *ec_to_pos) =0;
+
+  // Store a newly observed equivalence class `ec_id` identified by
+  // `key` (varies by alignment type, implement in children). `key` is
+  // the value returned by ec_key() for a read in the class. Used by the
+  // public collapse() method to create the equivalence classes with
+  // `collapse_hash`, `collapse_sort`, and `collapse_stream`.
+  virtual void add_ec(const TargetIds &key, const size_t ec_id) =0;
+
+  // Key that identifies the equivalence class of a read that aligned
+  // against the sorted target sequence ids in `targets`. Reads with
+  // equal keys are assigned to the same equivalence class. The default
+  // key is `targets`; children may compute a coarser key into `buffer`.
+  virtual TargetIds ec_key(const TargetIds &targets, std::vector<uint32_t>*) const { return targets; }
+
+  // Check that ec_key() returns sorted distinct values less than
+  // `n_refs`, which allows storing the keys as bitmasks when `n_refs`
+  // is small (see FixedECTable).
+  virtual bool ec_key_is_targets() const { return true; }
+
+  // Called once all equivalence classes have been added with add_ec()
+  // or insert(). Children that buffer the classes while collapsing
+  // should store them here.
+  virtual void flush_ecs() {}
+
+  void legacy_collapse(const bm::bvector<> &ec_configs) {
     // Need to hash the alignment patterns to count the times they appear.
     std::unordered_map<std::vector<bool>, uint32_t> ec_to_pos;
 
     size_t ec_id = 0;
+    size_t n_lookups = 0;
     for (size_t i = 0; i < this->n_reads(); ++i) {
       // Check if the current read aligned against any reference and
       // discard the read if it didn't.
       if (ec_configs.any_range(i*this->n_refs, i*this->n_refs + this->n_refs - 1)) {
 	// Copy the current alignment into a std::vector<bool> for hashing.
-	//
-	// TODO: implement the std::vector<bool> hash function
-	// for bm::bvector<> and use bm::copy_range?
-	//
 	std::vector<bool> current_ec(this->n_refs, false);
 	for (size_t j = 0; j < this->n_refs; ++j) {
 	  current_ec[j] = ec_configs[i*this->n_refs + j];
@@ -76,14 +104,355 @@ public:
 
 	// Insert the current equivalence class to the hash map or
 	// increment its observation count by 1 if it already exists.
-	this->insert(current_ec, i, &ec_id, &ec_to_pos, &bv_it);
+	this->insert(current_ec, i, &ec_id, &ec_to_pos);
+	this->n_unique += (ec_configs.count_range(i*this->n_refs, i*this->n_refs + this->n_refs - 1) == 1);
+	++n_lookups;
+      }
+    }
+    Metrics::global().add(counter_hash_probes, n_lookups);
+  }
+
+  // `for_each_row(first, last, f)` calls `f(read_id, targets)` for
+  // each aligned read in [first, last) (see ForEachRow).
+  template <typename Table, typename Rows>
+  void hash_collapse(const Rows &for_each_row) {
+    Table ec_to_pos;
+    std::vector<uint32_t> singleton_ecs(this->n_refs, unassigned);
+    std::vector<uint32_t> key_buffer;
+    for_each_row(0, this->n_reads(), [&](const size_t read_id, const TargetIds &targets) {
+      uint32_t ec_id;
+      if (targets.size() == 1) {
+	// Reads that aligned against a single target are looked up
+	// directly by the target; the table is only used the first time.
+	ec_id = singleton_ecs[targets[0]];
+	if (ec_id == unassigned) {
+	  ec_id = singleton_ecs[targets[0]] = this->find_or_add_ec(this->ec_key(targets, &key_buffer), &ec_to_pos);
+	}
+	++this->n_unique;
+      } else {
+	ec_id = this->find_or_add_ec(this->ec_key(targets, &key_buffer), &ec_to_pos);
+      }
+      this->assign_read(read_id, ec_id);
+    });
+    Metrics::global().add(counter_hash_probes, ec_to_pos.probes());
+  }
+
+  template <typename Table, typename Rows>
+  void parallel_hash_collapse(const Rows &for_each_row, const size_t n_threads) {
+    // Split the reads into `n_threads` contiguous ranges and collapse
+    // each range into a thread-local table.
+    size_t n_reads = this->n_reads();
+    size_t range_size = n_reads/n_threads + (n_reads % n_threads != 0);
+    std::vector<Table> local_ec_to_pos(n_threads, Table(0));
+    std::vector<std::vector<uint32_t>> local_ec_ids(n_threads); // Local ec id of each aligned read
+    std::vector<std::vector<uint32_t>> local_read_ids(n_threads);
+    std::vector<size_t> local_n_unique(n_threads, 0);
+
+#pragma omp parallel for schedule(static, 1) num_threads(n_threads)
+    for (size_t i = 0; i < n_threads; ++i) {
+      size_t first_read = std::min(i*range_size, n_reads);
+      size_t last_read = std::min(first_read + range_size, n_reads);
+      std::vector<uint32_t> singleton_ecs(this->n_refs, unassigned);
+      std::vector<uint32_t> key_buffer;
+      for_each_row(first_read, last_read, [&](const size_t read_id, const TargetIds &targets) {
+	uint32_t ec_id;
+	if (targets.size() == 1) {
+	  ec_id = singleton_ecs[targets[0]];
+	  if (ec_id == unassigned) {
+	    ec_id = singleton_ecs[targets[0]] = local_ec_to_pos[i].insert(this->ec_key(targets, &key_buffer)).first;
+	  }
+	  ++local_n_unique[i];
+	} else {
+	  ec_id = local_ec_to_pos[i].insert(this->ec_key(targets, &key_buffer)).first;
+	}
+	local_ec_ids[i].emplace_back(ec_id);
+	local_read_ids[i].emplace_back(read_id);
+      });
+    }
+    for (size_t i = 0; i < n_threads; ++i) {
+      this->n_unique += local_n_unique[i];
+    }
+
+    // Merge the local tables in the order of the read ranges. Local ids
+    // are in first-seen order within each range, so renumbering them
+    // through the global table gives the same ids as hash_collapse().
+    Table ec_to_pos;
+    std::vector<uint32_t> key_buffer;
+    for (size_t i = 0; i < n_threads; ++i) {
+      std::vector<uint32_t> local_to_global(local_ec_to_pos[i].size());
+      for (size_t j = 0; j < local_ec_to_pos[i].size(); ++j) {
+	local_to_global[j] = this->find_or_add_ec(local_ec_to_pos[i].ec_targets(j, &key_buffer), &ec_to_pos);
+      }
+      Metrics::global().add(counter_hash_probes, local_ec_to_pos[i].probes());
+      local_ec_to_pos[i] = Table(0);
+
+      for (size_t j = 0; j < local_ec_ids[i].size(); ++j) {
+	uint32_t ec_id = local_to_global[local_ec_ids[i][j]];
+	this->assign_read(local_read_ids[i][j], ec_id);
+      }
+      local_ec_ids[i] = std::vector<uint32_t>();
+      local_read_ids[i] = std::vector<uint32_t>();
+    }
+    Metrics::global().add(counter_hash_probes, ec_to_pos.probes());
+  }
+
+  template <typename Table, typename Rows>
+  void hash_collapse(const Rows &for_each_row, const size_t n_threads) {
+    if (n_threads > 1) {
+      this->parallel_hash_collapse<Table>(for_each_row, n_threads);
+    } else {
+      this->hash_collapse<Table>(for_each_row);
+    }
+  }
+
+  template <typename Rows>
+  void hash_collapse(const Rows &for_each_row, const size_t n_threads) {
+    // Use fixed-width bitmask keys if the targets fit in at most four words.
+    if (this->ec_key_is_targets() && this->n_refs <= 64) {
+      this->hash_collapse<FixedECTable<1>>(for_each_row, n_threads);
+    } else if (this->ec_key_is_targets() && this->n_refs <= 128) {
+      this->hash_collapse<FixedECTable<2>>(for_each_row, n_threads);
+    } else if (this->ec_key_is_targets() && this->n_refs <= 256) {
+      this->hash_collapse<FixedECTable<4>>(for_each_row, n_threads);
+    } else {
+      this->hash_collapse<ECTable>(for_each_row, n_threads);
+    }
+  }
+
+  template <typename Rows>
+  void sort_collapse(const Rows &for_each_row, size_t n_threads) {
+    // Store the key and signature of each aligned read in `n_threads`
+    // contiguous ranges of reads. Records are numbered in read order.
+    n_threads = std::max((size_t)1, n_threads);
+    size_t n_reads = this->n_reads();
+    size_t range_size = n_reads/n_threads + (n_reads % n_threads != 0);
+    std::vector<RowIndex> local_keys(n_threads);
+    std::vector<std::vector<uint32_t>> local_read_ids(n_threads);
+    std::vector<std::vector<SignedRecord>> local_records(n_threads);
+    std::vector<size_t> local_n_unique(n_threads, 0);
+
+#pragma omp parallel for schedule(static, 1) num_threads(n_threads)
+    for (size_t i = 0; i < n_threads; ++i) {
+      size_t first_read = std::min(i*range_size, n_reads);
+      size_t last_read = std::min(first_read + range_size, n_reads);
+      std::vector<uint32_t> key_buffer;
+      for_each_row(first_read, last_read, [&](const size_t read_id, const TargetIds &targets) {
+	const TargetIds &key = this->ec_key(targets, &key_buffer);
+	local_records[i].push_back(SignedRecord{ HashTargets(key.begin(), key.size()), (uint32_t)local_read_ids[i].size() });
+	local_keys[i].push_back(key);
+	local_read_ids[i].emplace_back(read_id);
+	local_n_unique[i] += (targets.size() == 1);
+      });
+    }
+
+    RowIndex keys = std::move(local_keys[0]);
+    std::vector<uint32_t> read_ids = std::move(local_read_ids[0]);
+    std::vector<SignedRecord> records = std::move(local_records[0]);
+    this->n_unique += local_n_unique[0];
+    for (size_t i = 1; i < n_threads; ++i) {
+      for (size_t j = 0; j < local_records[i].size(); ++j) {
+	local_records[i][j].record += read_ids.size();
+      }
+      keys.append(local_keys[i]);
+      read_ids.insert(read_ids.end(), local_read_ids[i].begin(), local_read_ids[i].end());
+      records.insert(records.end(), local_records[i].begin(), local_records[i].end());
+      this->n_unique += local_n_unique[i];
+      local_keys[i] = RowIndex();
+      local_read_ids[i] = std::vector<uint32_t>();
+      local_records[i] = std::vector<SignedRecord>();
+    }
+
+    RadixSortSignatures(&records, n_threads);
+
+    // Records with equal signatures are now adjacent and in increasing
+    // order. Point each record to the first record that has the same
+    // key; keys are compared to separate signature collisions.
+    size_t n_records = records.size();
+    std::vector<uint32_t> first_record(n_records);
+    std::vector<uint32_t> run_keys; // First record of each distinct key in the run
+    size_t run_start = 0;
+    for (size_t i = 0; i < n_records; ++i) {
+      if (records[i].signature != records[run_start].signature) {
+	run_start = i;
+	run_keys.clear();
+      }
+      uint32_t record = records[i].record;
+      const TargetIds &key = keys[record];
+      size_t j = 0;
+      while (j < run_keys.size() && !std::equal(key.begin(), key.end(), keys[run_keys[j]].begin(), keys[run_keys[j]].end())) {
+	++j;
+      }
+      if (j == run_keys.size()) {
+	run_keys.emplace_back(record);
+      }
+      first_record[record] = run_keys[j];
+    }
+    records = std::vector<SignedRecord>();
+
+    // Number the equivalence classes in the order of their first reads
+    // (same as hash_collapse()). The first record of each class is
+    // visited before the other records, so `first_record` can be
+    // overwritten with the class ids in place.
+    for (size_t i = 0; i < n_records; ++i) {
+      uint32_t ec_id;
+      if (first_record[i] == i) {
+	ec_id = this->n_ecs();
+	this->add_ec(keys[i], ec_id);
+	this->ec_counts.emplace_back(0);
+      } else {
+	ec_id = first_record[first_record[i]];
       }
+      first_record[i] = ec_id;
+      this->assign_read(read_ids[i], ec_id);
+    }
+  }
+
+  template <typename Table>
+  uint32_t find_or_add_ec(const TargetIds &key, Table *ec_to_pos) {
+    // Find the equivalence class of `key` or create a new one if
+    // the key has not been observed.
+    const std::pair<uint32_t, bool> &ec = ec_to_pos->insert(key);
+    if (ec.second) {
+      this->add_ec(key, ec.first);
+      this->ec_counts.emplace_back(0);
     }
-    bv_it.flush(); // Insert everything
+    return ec.first;
+  }
+
+protected:
+  // Number of reads in the alignment
+  uint32_t n_processed;
 
-    ec_configs.swap(compressed_ec_configs);
-    ec_configs.optimize();
-    ec_configs.freeze();
+  // Number of alignment targets
+  size_t n_refs;
+
+  // Number of times an alignment corresponding to each equivalence class was observed
+  std::vector<uint32_t> ec_counts;
+
+  // Number of reads that aligned against exactly one target
+  size_t n_unique = 0;
+
+  // IDs of reads that are assigned to each equivalence class. The reads
+  // in equivalence class `ec_id` are stored in
+  // aligned_reads[aligned_reads_offsets[ec_id]] ... aligned_reads[aligned_reads_offsets[ec_id + 1] - 1].
+  std::vector<size_t> aligned_reads_offsets;
+  std::vector<uint32_t> aligned_reads;
+
+  // Store the read IDs in `aligned_reads` when collapsing.
+  bool store_read_ids = true;
+
+  // Equivalence class of each read while collapsing (`unassigned` if the read did not align).
+  std::vector<uint32_t> read_to_ec;
+  static constexpr uint32_t unassigned = std::numeric_limits<uint32_t>::max();
+
+  // Receives the equivalence classes and read assignments while collapsing (or nullptr).
+  ECConsumer *consumer = nullptr;
+
+  // Assign read `read_id` to the equivalence class `ec_id`.
+  void assign_read(const size_t read_id, const uint32_t ec_id) {
+    this->ec_counts[ec_id] += 1;
+    if (this->store_read_ids) {
+      if (read_id >= this->read_to_ec.size()) {
+	this->read_to_ec.resize(std::max(read_id + 1, 2*this->read_to_ec.size()), unassigned);
+      }
+      this->read_to_ec[read_id] = ec_id;
+    }
+    if (this->consumer != nullptr) {
+      this->consumer->assign_read(read_id, ec_id);
+    }
+  }
+
+  // Invert `read_to_ec` into `aligned_reads` after collapsing.
+  void store_aligned_reads() {
+    this->aligned_reads_offsets = std::vector<size_t>(this->n_ecs() + 1, 0);
+    for (size_t i = 0; i < this->read_to_ec.size(); ++i) {
+      if (this->read_to_ec[i] != unassigned) {
+	++this->aligned_reads_offsets[this->read_to_ec[i] + 1];
+      }
+    }
+    for (size_t i = 0; i < this->n_ecs(); ++i) {
+      this->aligned_reads_offsets[i + 1] += this->aligned_reads_offsets[i];
+    }
+
+    // Read IDs are inserted in increasing order within each equivalence class.
+    this->aligned_reads = std::vector<uint32_t>(this->aligned_reads_offsets.back());
+    std::vector<size_t> next_pos(this->aligned_reads_offsets.begin(), this->aligned_reads_offsets.end() - 1);
+    for (size_t i = 0; i < this->read_to_ec.size(); ++i) {
+      if (this->read_to_ec[i] != unassigned) {
+	this->aligned_reads[next_pos[this->read_to_ec[i]]++] = i;
+      }
+    }
+    this->read_to_ec = std::vector<uint32_t>();
+  }
+
+  // Store the read assignments once all equivalence classes have been added.
+  void finish_collapse() {
+    this->flush_ecs();
+    this->store_aligned_reads();
+    if (this->consumer != nullptr) {
+      this->consumer->finish(this->n_reads());
+    }
+    Metrics::global().add(counter_ecs_created, this->n_ecs());
+  }
+
+public:
+  // Collapse the argument alignment into equivalence classes and their observation counts.
+  // Assumes that the internal variables `n_refs` and `n_processed` are the same as in the argument.
+  // The logic for storing the equivalence classes must be implemented in the insert() and add_ec()
+  // methods in each realization of the base class.
+  // With `n_threads` > 1 the reads are collapsed in parallel; the result is identical to
+  // collapsing with one thread. `collapse_legacy` always runs on one thread.
+  // The memory used by `ec_configs` is released after collapsing.
+  void collapse(bm::bvector<> &ec_configs, const collapse_engine engine = collapse_hash, const size_t n_threads = 1) {
+    ScopedPhase phase("collapse");
+    if (this->store_read_ids) {
+      this->read_to_ec = std::vector<uint32_t>(this->n_reads(), unassigned);
+    }
+
+    auto for_each_row = [&ec_configs, this](const size_t first, const size_t last, auto f) { ForEachRow(ec_configs, this->n_refs, first, last, f); };
+    if (engine == collapse_legacy) {
+      this->legacy_collapse(ec_configs);
+    } else if (engine == collapse_sort) {
+      this->sort_collapse(for_each_row, n_threads);
+    } else {
+      this->hash_collapse(for_each_row, n_threads);
+    }
+    ec_configs.clear(true);
+    this->finish_collapse();
+  }
+
+  // Collapse the reads stored in `rows` into equivalence classes and their observation counts.
+  // Sets `n_processed` to the number of rows. Always uses the `collapse_hash` engine.
+  void collapse(const RowIndex &rows, const size_t n_threads = 1) {
+    ScopedPhase phase("collapse");
+    this->n_processed = rows.n_rows();
+    if (this->store_read_ids) {
+      this->read_to_ec = std::vector<uint32_t>(this->n_reads(), unassigned);
+    }
+
+    auto for_each_row = [&rows](const size_t first, const size_t last, auto f) { rows.for_each_row(first, last, f); };
+    this->hash_collapse(for_each_row, n_threads);
+    this->finish_collapse();
+  }
+
+  // Collapse the reads returned by `reader` into equivalence classes and their observation counts.
+  // Each read is dropped after it has been assigned to an equivalence class so the full alignment
+  // is never stored in memory. Sets `n_processed` to the number of reads in `reader`.
+  void collapse(RowReader &reader) {
+    ScopedPhase phase("collapse");
+
+    // The reads are visited in the order they are read regardless of the range.
+    auto for_each_row = [&reader](const size_t, const size_t, auto f) {
+      size_t read_id;
+      std::vector<uint32_t> targets;
+      while (reader.next(&read_id, &targets)) {
+	f(read_id, TargetIds(targets.data(), targets.data() + targets.size()));
+      }
+    };
+    this->hash_collapse(for_each_row, 1);
+    this->n_processed = reader.n_reads();
+    Metrics::global().add(counter_reads_parsed, this->n_processed);
+    this->finish_collapse();
   }
 
   // Check if `row` aligned against `col`.
@@ -96,41 +465,75 @@ public:
   uint32_t n_targets() const { return this->n_refs; }
   size_t n_reads() const { return this->n_processed; }
 
+  // Get the number of reads that aligned against exactly one target
+  size_t n_unique_reads() const { return this->n_unique; }
+
   // Get number times an equivalence class was observed
   size_t reads_in_ec(const size_t &ec_id) const { return this->ec_counts[ec_id]; }
 
   // Get the IDs of reads assigned to an equivalence class
-  const std::vector<uint32_t>& reads_assigned_to_ec(const size_t &ec_id) const { return this->aligned_reads[ec_id]; }
+  ReadIds reads_assigned_to_ec(const size_t &ec_id) const {
+    if (this->aligned_reads_offsets.empty()) {
+      return ReadIds(nullptr, nullptr);
+    }
+    const uint32_t *first = this->aligned_reads.data() + this->aligned_reads_offsets[ec_id];
+    return ReadIds(first, first + (this->aligned_reads_offsets[ec_id + 1] - this->aligned_reads_offsets[ec_id]));
+  }
 
-  // Get all aligned reads
-  const std::vector<std::vector<uint32_t>>& get_aligned_reads() const { return this->aligned_reads; }
+  // Get all aligned reads, ordered by equivalence class. Use get_aligned_reads_offsets() to find the
+  // reads that belong to each class.
+  const std::vector<uint32_t>& get_aligned_reads() const { return this->aligned_reads; }
+  const std::vector<size_t>& get_aligned_reads_offsets() const { return this->aligned_reads_offsets; }
+
+  // Set whether to store the IDs of the reads assigned to each equivalence class when collapsing
+  // (default: true). The observation counts are stored regardless.
+  void set_store_read_ids(const bool store) { this->store_read_ids = store; }
 };
 
 class ThemistoAlignment : public Alignment{
 private:
-  // Store the pseudoalignment as a n_reads (rows) x n_refs (columns) matrix
+  // Store the pseudoalignment as a n_reads (rows) x n_refs (columns)
+  // matrix until it is collapsed.
   bm::bvector<> ec_configs;
 
+  // Sorted targets of each equivalence class after collapsing.
+  RowIndex ec_targets;
+
+  // First read id of each lane followed by the total number of reads
+  // if the alignment was concatenated from several files (empty otherwise).
+  std::vector<size_t> lane_offsets;
+
   // Implement insert() from the base class
-  void insert(const std::vector<bool> &current_ec, const size_t &i, size_t *ec_id, std::unordered_map<std::vector<bool>, uint32_t> *ec_to_pos, bm::bvector<>::bulk_insert_iterator *bv_it) override {
+  void insert(const std::vector<bool> &current_ec, const size_t &i, size_t *ec_id, std::unordered_map<std::vector<bool>, uint32_t> *ec_to_pos) override {
     // Check if the pattern has been observed
     std::unordered_map<std::vector<bool>, uint32_t>::iterator it = ec_to_pos->find(current_ec);
     if (it == ec_to_pos->end()) {
-      // Add new patterns to compressed_ec_configs.
+      // Add new patterns to ec_targets.
+      std::vector<uint32_t> targets;
       for (size_t j = 0; j < this->n_refs; ++j) {
 	if (current_ec[j]) {
-	  *bv_it = (*ec_id)*this->n_refs + j;
+	  targets.emplace_back(j);
 	}
       }
+      this->ec_targets.push_back(TargetIds(targets.data(), targets.data() + targets.size()));
+      if (this->consumer != nullptr) {
+	this->consumer->new_ec(*ec_id, this->ec_targets[*ec_id]);
+      }
       // Add a new counter for the new pattern
       this->ec_counts.emplace_back(0);
       // Insert the new pattern into the hashmap
       it = ec_to_pos->insert(std::make_pair(current_ec, *ec_id)).first; // return iterator to inserted element
-      this->aligned_reads.emplace_back(std::vector<uint32_t>());
       ++(*ec_id);
     }
-    this->ec_counts[it->second] += 1; // Increment number of times the pattern was observed
-    this->aligned_reads[it->second].emplace_back(i);
+    this->assign_read(i, it->second); // Increment number of times the pattern was observed
+  }
+
+  // Implement add_ec() from the base class
+  void add_ec(const TargetIds &targets, const size_t ec_id) override {
+    this->ec_targets.push_back(targets);
+    if (this->consumer != nullptr) {
+      this->consumer->new_ec(ec_id, targets);
+    }
   }
 
 public:
@@ -140,6 +543,7 @@ public:
     this->n_refs = _n_refs;
     this->n_processed = 0;
     this->ec_configs = std::move(ec_configs);
+    this->ec_targets = RowIndex(_n_refs);
   }
 
   ThemistoAlignment(const size_t &_n_refs, const size_t &_n_reads, bm::bvector<> &ec_configs) {
@@ -147,16 +551,62 @@ public:
     this->n_refs = _n_refs;
     this->n_processed = _n_reads;
     this->ec_configs = std::move(ec_configs);
+    this->ec_targets = RowIndex(_n_refs);
+  }
+
+  ThemistoAlignment(const size_t &_n_refs) {
+    // Constructor for collapsing from a RowIndex or a RowReader
+    this->n_refs = _n_refs;
+    this->n_processed = 0;
+    this->ec_targets = RowIndex(_n_refs);
+  }
+
+  ThemistoAlignment(const size_t _n_reads, RowIndex &&_ec_targets, std::vector<uint32_t> &&_ec_counts, std::vector<size_t> &&_aligned_reads_offsets, std::vector<uint32_t> &&_aligned_reads) {
+    // Constructor for an alignment that has already been collapsed,
+    // eg. one read from a telescope::ECIndex. `_aligned_reads_offsets`
+    // and `_aligned_reads` are empty if the read IDs were not stored.
+    this->n_refs = _ec_targets.n_targets();
+    this->n_processed = _n_reads;
+    this->ec_targets = std::move(_ec_targets);
+    this->ec_counts = std::move(_ec_counts);
+    this->aligned_reads_offsets = std::move(_aligned_reads_offsets);
+    this->aligned_reads = std::move(_aligned_reads);
+
+    for (size_t ec_id = 0; ec_id < this->n_ecs(); ++ec_id) {
+      this->n_unique += (this->ec_targets[ec_id].size() == 1 ? this->ec_counts[ec_id] : 0);
+    }
   }
 
   // Check if ec_id `row` aligned against group `col`.
-  size_t operator()(const size_t row, const size_t col) const override { return this->ec_configs[row*this->n_refs + col]; }
+  size_t operator()(const size_t row, const size_t col) const override { return this->ec_targets(row, col); }
 
   // Collapse the stored pseudoalignment into equivalence classes and their observation counts.
-  void collapse() { Alignment::collapse(this->ec_configs); }
+  void collapse(const collapse_engine engine = collapse_hash, const size_t n_threads = 1) { Alignment::collapse(this->ec_configs, engine, n_threads); }
+
+  // Collapse the pseudoalignment read from `reader` without storing it.
+  void collapse(RowReader &reader) { Alignment::collapse(reader); }
 
-  // Get the ec_configs
+  // Collapse the pseudoalignment stored in `rows`.
+  void collapse(const RowIndex &rows, const size_t n_threads = 1) { Alignment::collapse(rows, n_threads); }
+
+  // Pass the equivalence classes and the read assignments to `_consumer` while collapsing
+  // (see ECConsumer.hpp); nullptr stops passing them. Combine with set_store_read_ids(false)
+  // to not store the read assignments in this object.
+  void set_consumer(ECConsumer *_consumer) { this->consumer = _consumer; }
+
+  // Get the uncollapsed pseudoalignment. Empty after collapse(); the
+  // equivalence classes are then available through get_ec_targets().
   const bm::bvector<> &get_configs() const { return this->ec_configs; }
+
+  // Get the sorted targets of an equivalence class
+  TargetIds ec_target_ids(const size_t ec_id) const { return this->ec_targets[ec_id]; }
+
+  // Get the targets of all equivalence classes
+  const RowIndex &get_ec_targets() const { return this->ec_targets; }
+
+  // Set or get the first read id of each concatenated file followed by the total number of reads.
+  void set_lane_offsets(std::vector<size_t> &&_lane_offsets) { this->lane_offsets = std::move(_lane_offsets); }
+  const std::vector<size_t> &get_lane_offsets() const { return this->lane_offsets; }
 };
 
 template <typename T, typename V>
@@ -172,25 +622,138 @@ private:
   // equivalence class aligned against.
   bm::sparse_vector<T, bm::bvector<>> sparse_group_counts;
 
+  // Collapse reads on the number of targets they aligned against in
+  // each group instead of on the targets themselves.
+  bool collapse_on_groups = false;
+
+  // Bulk insert iterators into the bit-planes of sparse_group_counts.
+  // Counts are written bit by bit through these while collapsing, which
+  // is much cheaper than calling inc() for each target. The iterators
+  // are flushed in flush_ecs().
+  std::vector<std::unique_ptr<bm::bvector<>::bulk_insert_iterator>> plane_inserters;
+
+  // Scratch space for counting the targets of one equivalence class in each group.
+  std::vector<T> group_count_scratch;
+  std::vector<uint32_t> touched_groups;
+
+  // Count the targets in each group as sorted (group, count) pairs of
+  // the groups with nonzero counts, stored at the end of `buffer`.
+  TargetIds count_groups(const TargetIds &targets, std::vector<uint32_t> *buffer) const {
+    // Sort the groups of the targets into the front of `buffer` and
+    // append the pairs after them.
+    buffer->clear();
+    for (size_t j = 0; j < targets.size(); ++j) {
+      buffer->emplace_back(this->group_indicators[targets[j]]);
+    }
+    std::sort(buffer->begin(), buffer->end());
+    size_t n_targets = buffer->size();
+    for (size_t j = 0; j < n_targets; ++j) {
+      if (j == 0 || (*buffer)[j] != (*buffer)[j - 1]) {
+	buffer->emplace_back((*buffer)[j]);
+	buffer->emplace_back(1);
+      } else {
+	++buffer->back();
+      }
+    }
+    return TargetIds(buffer->data() + n_targets, buffer->data() + buffer->size());
+  }
+
+  // Store `count` at position `pos` of sparse_group_counts.
+  void set_group_count(const size_t pos, T count) {
+    for (unsigned plane = 0; count > 0; ++plane, count >>= 1) {
+      if (count & 1) {
+	if (plane >= this->plane_inserters.size()) {
+	  this->plane_inserters.resize(plane + 1);
+	}
+	if (!this->plane_inserters[plane]) {
+	  this->plane_inserters[plane].reset(new bm::bvector<>::bulk_insert_iterator(*this->sparse_group_counts.get_create_slice(plane)));
+	}
+	*this->plane_inserters[plane] = pos;
+      }
+    }
+  }
+
+  // Store the (group, count) pairs in `counts` for equivalence class `ec_id`.
+  void add_group_counts(const TargetIds &counts, const size_t ec_id) {
+    size_t read_start = ec_id*this->n_groups;
+    for (size_t j = 0; j < counts.size(); j += 2) {
+      this->set_group_count(read_start + counts[j], counts[j + 1]);
+    }
+  }
+
+  // Count the targets in each group and store the counts for equivalence class `ec_id`.
+  void add_target_counts(const TargetIds &targets, const size_t ec_id) {
+    if (this->group_count_scratch.size() < this->n_groups) {
+      this->group_count_scratch.resize(this->n_groups, 0);
+    }
+    for (size_t j = 0; j < targets.size(); ++j) {
+      V group = this->group_indicators[targets[j]];
+      if (this->group_count_scratch[group] == 0) {
+	this->touched_groups.emplace_back(group);
+      }
+      ++this->group_count_scratch[group];
+    }
+    size_t read_start = ec_id*this->n_groups;
+    for (size_t j = 0; j < this->touched_groups.size(); ++j) {
+      this->set_group_count(read_start + this->touched_groups[j], this->group_count_scratch[this->touched_groups[j]]);
+      this->group_count_scratch[this->touched_groups[j]] = 0;
+    }
+    this->touched_groups.clear();
+  }
+
   // Implement insert() from the base class
-  void insert(const std::vector<bool> &current_ec, const size_t &i, size_t *ec_id, std::unordered_map<std::vector<bool>, uint32_t> *ec_to_pos, bm::bvector<>::bulk_insert_iterator*) override {
+  void insert(const std::vector<bool> &current_ec, const size_t &i, size_t *ec_id, std::unordered_map<std::vector<bool>, uint32_t> *ec_to_pos) override {
     // Check if the pattern has been observed
     std::unordered_map<std::vector<bool>, uint32_t>::iterator it = ec_to_pos->find(current_ec);
     if (it == ec_to_pos->end()) {
       this->ec_counts.emplace_back(0);
       it = ec_to_pos->insert(std::make_pair(current_ec, (uint32_t)*ec_id)).first;
 
-      size_t read_start = (*ec_id)*this->n_groups;
+      std::vector<uint32_t> targets;
       for (size_t j = 0; j  < this->n_refs; ++j) {
 	if (current_ec[j]) {
-	  this->sparse_group_counts.inc(read_start + this->group_indicators[j]);
+	  targets.emplace_back(j);
 	}
       }
-      this->aligned_reads.emplace_back(std::vector<uint32_t>());
+      this->add_target_counts(TargetIds(targets.data(), targets.data() + targets.size()), *ec_id);
       ++(*ec_id);
     }
-    this->ec_counts[it->second] += 1;
-    this->aligned_reads[it->second].emplace_back(i);
+    this->assign_read(i, it->second);
+  }
+
+  // Implement add_ec() from the base class
+  void add_ec(const TargetIds &key, const size_t ec_id) override {
+    if (this->collapse_on_groups) {
+      // `key` already contains the (group, count) pairs, see ec_key().
+      this->add_group_counts(key, ec_id);
+    } else {
+      this->add_target_counts(key, ec_id);
+    }
+  }
+
+  // Implement ec_key() from the base class
+  TargetIds ec_key(const TargetIds &targets, std::vector<uint32_t> *key) const override {
+    if (!this->collapse_on_groups) {
+      return targets;
+    }
+    return this->count_groups(targets, key);
+  }
+
+  // Implement ec_key_is_targets() from the base class
+  bool ec_key_is_targets() const override { return !this->collapse_on_groups; }
+
+  // Implement flush_ecs() from the base class
+  void flush_ecs() override {
+    for (size_t plane = 0; plane < this->plane_inserters.size(); ++plane) {
+      if (this->plane_inserters[plane]) {
+	this->plane_inserters[plane]->flush();
+      }
+    }
+    this->plane_inserters.clear();
+    this->sparse_group_counts.resize(this->n_ecs()*this->n_groups);
+    this->sparse_group_counts.optimize();
+    Metrics::global().add(counter_bvector_optimize, 1);
+    this->group_count_scratch = std::vector<T>();
   }
 
 public:
@@ -207,10 +770,15 @@ public:
     this->sparse_group_counts = bm::sparse_vector<T, bm::bvector<>>();
   }
 
-  GroupedAlignment(const size_t _n_refs, const size_t _n_groups, const size_t _n_reads, const std::vector<V> _group_indicators) {
+  // With `_collapse_on_groups` reads that aligned against the same number of targets in each
+  // group are assigned to the same equivalence class (collapse_hash, collapse_sort, and
+  // collapse_stream only; collapse_legacy always uses the aligned targets, so
+  // read::ThemistoGrouped rejects collapse_legacy with `_collapse_on_groups`).
+  GroupedAlignment(const size_t _n_refs, const size_t _n_groups, const size_t _n_reads, const std::vector<V> _group_indicators, const bool _collapse_on_groups = false) {
     this->n_refs = _n_refs;
     this->n_groups = _n_groups;
     this->group_indicators = _group_indicators;
+    this->collapse_on_groups = _collapse_on_groups;
     this->n_processed = _n_reads;
     this->sparse_group_counts = bm::sparse_vector<T, bm::bvector<>>();
   }
@@ -221,8 +789,18 @@ public:
     return this->sparse_group_counts[pos];
   }
 
+  // Get the number of sequences in each group that the ec_id aligned against.
+  // Faster than calling get_group_count() for each group.
+  void get_group_counts(const size_t ec_id, std::vector<T> *counts) const {
+    counts->resize(this->n_groups);
+    this->sparse_group_counts.decode(counts->data(), ec_id*this->n_groups, this->n_groups);
+  }
+
   size_t operator()(const size_t row, const size_t col) const override { return this->get_group_count(row, col); }
 
+  // Get the group counts of all equivalence classes (position ec_id*n_groups + group_id).
+  const bm::sparse_vector<T, bm::bvector<>> &get_sparse_group_counts() const { return this->sparse_group_counts; }
+
 };
 }
 
@@ -0,0 +1,70 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#ifndef TELESCOPE_ALIGNMENTCACHE_HPP
+#define TELESCOPE_ALIGNMENTCACHE_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "bmconst.h"
+
+#include "Alignment.hpp"
+#include "TargetSubset.hpp"
+
+namespace telescope {
+// telescope::AlignmentCache
+//
+// Directory of collapsed alignments stored as equivalence class
+// indexes (see ECIndex.hpp). The entries are named by a fingerprint
+// of the input files and the settings that change the collapsed
+// alignment, so converting the same inputs again loads the result
+// instead of reading and collapsing the inputs. The least recently
+// used entries are removed when the directory grows past `max_bytes`.
+class AlignmentCache {
+private:
+  std::string dir;
+  size_t max_bytes;
+
+  std::string entry_path(const std::string &key) const { return this->dir + "/" + key + ".idx"; }
+
+  // Remove the least recently used entries until the entries take at most `max_bytes`.
+  void evict() const;
+
+public:
+  // Creates `_dir` if it does not exist.
+  AlignmentCache(const std::string &_dir, const size_t _max_bytes);
+
+  // Fingerprint of the alignment read from the files in `paths` with
+  // the given settings. Uses the size, modification time, and the bytes
+  // at the start, middle, and end of each file, and the kept targets if
+  // `subset` is not nullptr.
+  std::string key(const std::vector<std::string> &paths, const size_t n_refs, const bm::set_operation &merge_op, const bool store_read_ids, const TargetSubset *subset = nullptr) const;
+
+  // Load the alignment stored under `key` into `aln`. Returns false if
+  // there is no usable entry.
+  bool load(const std::string &key, const size_t n_refs, ThemistoAlignment *aln) const;
+
+  // Store the collapsed alignment `aln` under `key` and remove old
+  // entries if the cache is full.
+  void store(const std::string &key, const ThemistoAlignment &aln) const;
+};
+}
+
+#endif
@@ -0,0 +1,54 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#ifndef TELESCOPE_ECCONSUMER_HPP
+#define TELESCOPE_ECCONSUMER_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "RowIndex.hpp"
+
+namespace telescope {
+// telescope::ECConsumer
+//
+// Interface for receiving the equivalence classes and the read
+// assignments while a ThemistoAlignment is collapsed (see
+// ThemistoAlignment::set_consumer and read::ThemistoToConsumer). All calls
+// are made from the thread that called collapse().
+class ECConsumer {
+public:
+  virtual ~ECConsumer() = default;
+
+  // Called once for each new equivalence class with its sorted target
+  // sequence ids. The classes are passed in increasing order of
+  // `ec_id` starting from 0. `targets` is only valid during the call.
+  virtual void new_ec(const uint32_t ec_id, const TargetIds &targets) =0;
+
+  // Called once for each aligned read after the class `ec_id` has been
+  // passed to new_ec(). The order of the reads depends on the collapse
+  // engine and the number of threads.
+  virtual void assign_read(const size_t read_id, const uint32_t ec_id) =0;
+
+  // Called after all reads have been assigned with the total number of
+  // reads (unaligned + aligned) in the alignment.
+  virtual void finish(const size_t) {}
+};
+}
+
+#endif
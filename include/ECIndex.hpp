@@ -0,0 +1,238 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#ifndef TELESCOPE_ECINDEX_HPP
+#define TELESCOPE_ECINDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <exception>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Alignment.hpp"
+
+namespace telescope {
+// Binary equivalence class index file format (version 1).
+//
+// All values are stored in the byte order of the machine that wrote
+// the file and each section starts at a multiple of 8 bytes.
+//   ECIndexHeader
+//   uint64_t ec_target_offsets[n_ecs + 1]   Targets of ec `i` are in
+//   uint32_t ec_targets[n_ec_targets]       ec_targets[ec_target_offsets[i]] ... ec_targets[ec_target_offsets[i + 1] - 1]
+//   uint32_t ec_counts[n_ecs]               Number of reads in each ec
+//   uint64_t read_offsets[n_ecs + 1]        Reads assigned to ec `i` are in
+//   uint32_t read_ids[n_aligned_reads]      read_ids[read_offsets[i]] ... read_ids[read_offsets[i + 1] - 1]
+struct ECIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t n_targets;
+  uint64_t n_reads;
+  uint64_t n_ecs;
+  uint64_t n_ec_targets;
+  uint64_t n_aligned_reads;
+};
+
+constexpr char ec_index_magic[8] = { 'T', 'L', 'S', 'C', 'P', 'I', 'D', 'X' };
+constexpr uint32_t ec_index_version = 1;
+constexpr uint32_t ec_index_byte_order = 0x01020304;
+
+// Size of a section of `n` values of type T padded to a multiple of 8 bytes.
+template <typename T>
+size_t ECIndexSectionSize(const size_t n) { return (n*sizeof(T) + 7)/8*8; }
+
+// telescope::ECIndex
+//
+// Read-only view into a binary equivalence class index file written
+// with telescope::write::ECIndexFile. The file is memory-mapped and
+// the accessors point directly into the mapping, so opening the index
+// does not copy or parse its contents.
+class ECIndex {
+private:
+  void *data = MAP_FAILED;
+  size_t file_size = 0;
+
+  const ECIndexHeader *header;
+  const uint64_t *ec_target_offsets;
+  const uint32_t *ec_targets;
+  const uint32_t *ec_counts;
+  const uint64_t *read_offsets;
+  const uint32_t *read_ids;
+
+  void unmap() {
+    if (this->data != MAP_FAILED) {
+      munmap(this->data, this->file_size);
+      this->data = MAP_FAILED;
+    }
+  }
+
+  // Check that `offsets` has `n_sections + 1` values that start from 0,
+  // never decrease, and end at `n_values`.
+  static bool valid_offsets(const uint64_t *offsets, const size_t n_sections, const uint64_t n_values) {
+    if (offsets[0] != 0 || offsets[n_sections] != n_values) {
+      return false;
+    }
+    for (size_t i = 0; i < n_sections; ++i) {
+      if (offsets[i + 1] < offsets[i]) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  void swap(ECIndex &other) {
+    std::swap(this->data, other.data);
+    std::swap(this->file_size, other.file_size);
+    std::swap(this->header, other.header);
+    std::swap(this->ec_target_offsets, other.ec_target_offsets);
+    std::swap(this->ec_targets, other.ec_targets);
+    std::swap(this->ec_counts, other.ec_counts);
+    std::swap(this->read_offsets, other.read_offsets);
+    std::swap(this->read_ids, other.read_ids);
+  }
+
+public:
+  ECIndex(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw std::runtime_error("File " + path + " is not accessible.");
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ECIndexHeader)) {
+      close(fd);
+      throw std::runtime_error("File " + path + " is not a telescope equivalence class index.");
+    }
+    this->file_size = st.st_size;
+    this->data = mmap(nullptr, this->file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (this->data == MAP_FAILED) {
+      throw std::runtime_error("Could not memory-map file " + path + ".");
+    }
+
+    const char *pos = static_cast<const char*>(this->data);
+    this->header = reinterpret_cast<const ECIndexHeader*>(pos);
+    if (std::memcmp(this->header->magic, ec_index_magic, 8) != 0) {
+      this->unmap();
+      throw std::runtime_error("File " + path + " is not a telescope equivalence class index.");
+    }
+    if (this->header->byte_order != ec_index_byte_order) {
+      this->unmap();
+      throw std::runtime_error("File " + path + " was written on a machine with a different byte order.");
+    }
+    if (this->header->version != ec_index_version) {
+      this->unmap();
+      throw std::runtime_error("File " + path + " has unsupported version " + std::to_string(this->header->version) + ".");
+    }
+
+    // Counts that can't fit in the file are rejected before computing
+    // the expected size so that it does not overflow.
+    if (this->header->n_ecs >= this->file_size/sizeof(uint64_t) || this->header->n_ec_targets > this->file_size/sizeof(uint32_t)
+	|| this->header->n_aligned_reads > this->file_size/sizeof(uint32_t)) {
+      this->unmap();
+      throw std::runtime_error("File " + path + " is truncated.");
+    }
+    size_t expected_size = sizeof(ECIndexHeader) + ECIndexSectionSize<uint64_t>(this->n_ecs() + 1) + ECIndexSectionSize<uint32_t>(this->header->n_ec_targets)
+      + ECIndexSectionSize<uint32_t>(this->n_ecs()) + ECIndexSectionSize<uint64_t>(this->n_ecs() + 1) + ECIndexSectionSize<uint32_t>(this->header->n_aligned_reads);
+    if (this->file_size < expected_size) {
+      this->unmap();
+      throw std::runtime_error("File " + path + " is truncated.");
+    }
+
+    pos += sizeof(ECIndexHeader);
+    this->ec_target_offsets = reinterpret_cast<const uint64_t*>(pos);
+    pos += ECIndexSectionSize<uint64_t>(this->n_ecs() + 1);
+    this->ec_targets = reinterpret_cast<const uint32_t*>(pos);
+    pos += ECIndexSectionSize<uint32_t>(this->header->n_ec_targets);
+    this->ec_counts = reinterpret_cast<const uint32_t*>(pos);
+    pos += ECIndexSectionSize<uint32_t>(this->n_ecs());
+    this->read_offsets = reinterpret_cast<const uint64_t*>(pos);
+    pos += ECIndexSectionSize<uint64_t>(this->n_ecs() + 1);
+    this->read_ids = reinterpret_cast<const uint32_t*>(pos);
+
+    if (!valid_offsets(this->ec_target_offsets, this->n_ecs(), this->header->n_ec_targets)
+	|| !valid_offsets(this->read_offsets, this->n_ecs(), this->header->n_aligned_reads)) {
+      this->unmap();
+      throw std::runtime_error("File " + path + " has invalid offsets.");
+    }
+    for (size_t i = 0; i < this->header->n_ec_targets; ++i) {
+      if (this->ec_targets[i] >= this->header->n_targets) {
+	this->unmap();
+	throw std::runtime_error("File " + path + " has a target id that is out of range.");
+      }
+    }
+  }
+
+  ~ECIndex() { this->unmap(); }
+
+  ECIndex(const ECIndex&) = delete;
+  ECIndex& operator=(const ECIndex&) = delete;
+  ECIndex(ECIndex &&other)
+    : data(other.data), file_size(other.file_size), header(other.header), ec_target_offsets(other.ec_target_offsets),
+      ec_targets(other.ec_targets), ec_counts(other.ec_counts), read_offsets(other.read_offsets), read_ids(other.read_ids) {
+    other.data = MAP_FAILED;
+  }
+  ECIndex& operator=(ECIndex &&other) {
+    if (this != &other) {
+      this->unmap();
+      this->swap(other);
+    }
+    return *this;
+  }
+
+  // Get the dimensions of the alignment
+  size_t n_targets() const { return this->header->n_targets; }
+  size_t n_reads() const { return this->header->n_reads; }
+  size_t n_ecs() const { return this->header->n_ecs; }
+
+  // Get the number of stored read IDs (0 if they were not stored)
+  size_t n_aligned_reads() const { return this->header->n_aligned_reads; }
+
+  // Sorted targets of the equivalence class `ec_id`.
+  const uint32_t* ec_begin(const size_t ec_id) const { return this->ec_targets + this->ec_target_offsets[ec_id]; }
+  const uint32_t* ec_end(const size_t ec_id) const { return this->ec_targets + this->ec_target_offsets[ec_id + 1]; }
+
+  // Get number times an equivalence class was observed
+  size_t reads_in_ec(const size_t ec_id) const { return this->ec_counts[ec_id]; }
+
+  // Get the IDs of reads assigned to an equivalence class
+  ReadIds reads_assigned_to_ec(const size_t ec_id) const { return ReadIds(this->read_ids + this->read_offsets[ec_id], this->read_ids + this->read_offsets[ec_id + 1]); }
+};
+
+namespace read {
+// telescope::read::ECIndexFile
+//
+// Open a binary equivalence class index written with
+// telescope::write::ECIndexFile.
+//
+// Input:
+//   `path`: path to the index file.
+// Output:
+//   `index`: memory-mapped view into the index.
+inline ECIndex ECIndexFile(const std::string &path) { return ECIndex(path); }
+}
+}
+
+#endif
@@ -0,0 +1,275 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#ifndef TELESCOPE_ECTABLE_HPP
+#define TELESCOPE_ECTABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+#include "RowIndex.hpp"
+
+namespace telescope {
+// telescope::HashTargets
+//
+// Hash a sorted list of target sequence ids.
+inline uint64_t HashTargets(const uint32_t *targets, const size_t n_targets) {
+  uint64_t h = 0x9E3779B97F4A7C15ULL ^ n_targets;
+  for (size_t i = 0; i < n_targets; ++i) {
+    h ^= targets[i];
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 31;
+  }
+  // splitmix64 finalizer
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBULL;
+  h ^= h >> 31;
+  return h;
+}
+
+// telescope::ECTable
+//
+// Open-addressing hash table that maps alignment patterns, given as
+// sorted lists of target sequence ids, to equivalence class ids. The
+// ids are assigned in insertion order starting from 0. The patterns
+// themselves are stored contiguously so inserting a pattern does not
+// allocate unless the storage has to grow.
+class ECTable {
+private:
+  // Slots of the table. Each slot stores the upper 32 bits of the
+  // pattern hash and the equivalence class id + 1 (0 marks an empty slot).
+  std::vector<uint64_t> slots;
+  size_t mask;
+
+  // Hash of each stored pattern, used when the table grows.
+  std::vector<uint64_t> hashes;
+
+  // Targets of equivalence class `ec_id` are stored in
+  // targets[offsets[ec_id]] ... targets[offsets[ec_id + 1] - 1].
+  std::vector<uint32_t> targets;
+  std::vector<size_t> offsets;
+
+  // Number of slots examined in insert().
+  size_t n_probes = 0;
+
+  bool equals(const uint32_t ec_id, const uint32_t *key, const size_t len) const {
+    if (this->offsets[ec_id + 1] - this->offsets[ec_id] != len) {
+      return false;
+    }
+    const uint32_t *stored = this->targets.data() + this->offsets[ec_id];
+    for (size_t i = 0; i < len; ++i) {
+      if (stored[i] != key[i]) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  void grow() {
+    // Double the number of slots and reinsert the stored patterns.
+    this->slots = std::vector<uint64_t>(2*this->slots.size(), 0);
+    this->mask = this->slots.size() - 1;
+    for (uint32_t ec_id = 0; ec_id < this->hashes.size(); ++ec_id) {
+      size_t pos = this->hashes[ec_id] & this->mask;
+      while (this->slots[pos] != 0) {
+	pos = (pos + 1) & this->mask;
+      }
+      this->slots[pos] = ((this->hashes[ec_id] >> 32) << 32) | (ec_id + 1);
+    }
+  }
+
+public:
+  ECTable(const size_t initial_size = 1024) {
+    size_t n_slots = 16;
+    while (n_slots < 2*initial_size) {
+      n_slots <<= 1;
+    }
+    this->slots = std::vector<uint64_t>(n_slots, 0);
+    this->mask = n_slots - 1;
+    this->offsets.emplace_back(0);
+  }
+
+  // Find the equivalence class of the pattern in `key` (length `len`)
+  // or insert it as a new class if it has not been observed. Returns
+  // the class id and whether the pattern was inserted.
+  std::pair<uint32_t, bool> insert(const uint32_t *key, const size_t len) {
+    uint64_t hash = HashTargets(key, len);
+    uint64_t fingerprint = hash >> 32;
+    size_t pos = hash & this->mask;
+    while (this->slots[pos] != 0) {
+      ++this->n_probes;
+      uint64_t slot = this->slots[pos];
+      uint32_t ec_id = (slot & 0xFFFFFFFFULL) - 1;
+      if ((slot >> 32) == fingerprint && this->equals(ec_id, key, len)) {
+	return std::make_pair(ec_id, false);
+      }
+      pos = (pos + 1) & this->mask;
+    }
+    ++this->n_probes;
+
+    uint32_t ec_id = this->hashes.size();
+    this->slots[pos] = (fingerprint << 32) | (ec_id + 1);
+    this->hashes.emplace_back(hash);
+    this->targets.insert(this->targets.end(), key, key + len);
+    this->offsets.emplace_back(this->targets.size());
+
+    // Keep the load factor at or below 1/2.
+    if (2*this->hashes.size() > this->slots.size()) {
+      this->grow();
+    }
+    return std::make_pair(ec_id, true);
+  }
+
+  std::pair<uint32_t, bool> insert(const TargetIds &key) { return this->insert(key.begin(), key.size()); }
+
+  // Number of equivalence classes in the table.
+  size_t size() const { return this->hashes.size(); }
+
+  // Number of slots examined in insert() so far.
+  size_t probes() const { return this->n_probes; }
+
+  // Sorted targets of the equivalence class `ec_id`.
+  const uint32_t* ec_begin(const size_t ec_id) const { return this->targets.data() + this->offsets[ec_id]; }
+  const uint32_t* ec_end(const size_t ec_id) const { return this->targets.data() + this->offsets[ec_id + 1]; }
+  TargetIds ec_targets(const size_t ec_id, std::vector<uint32_t>*) const { return TargetIds(this->ec_begin(ec_id), this->ec_end(ec_id)); }
+};
+
+// telescope::FixedECTable
+//
+// Same as ECTable for alignments with at most 64*N targets. The
+// patterns are stored as fixed-width bitmasks of N words, so hashing
+// and comparing a pattern does not depend on how many targets it has
+// and the stored patterns take N words each.
+template <size_t N>
+class FixedECTable {
+private:
+  // Slots of the table, same layout as in ECTable.
+  std::vector<uint64_t> slots;
+  size_t mask;
+
+  // Bitmask of equivalence class `ec_id` is stored in
+  // masks[ec_id*N] ... masks[ec_id*N + N - 1].
+  std::vector<uint64_t> masks;
+
+  // Number of slots examined in insert().
+  size_t n_probes = 0;
+
+  static uint64_t hash(const uint64_t *words) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < N; ++i) {
+      h ^= words[i];
+      h *= 0xBF58476D1CE4E5B9ULL;
+      h ^= h >> 31;
+    }
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 29;
+    return h;
+  }
+
+  bool equals(const uint32_t ec_id, const uint64_t *words) const {
+    const uint64_t *stored = this->masks.data() + ec_id*N;
+    for (size_t i = 0; i < N; ++i) {
+      if (stored[i] != words[i]) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  void grow() {
+    this->slots = std::vector<uint64_t>(2*this->slots.size(), 0);
+    this->mask = this->slots.size() - 1;
+    for (uint32_t ec_id = 0; ec_id < this->size(); ++ec_id) {
+      uint64_t h = hash(this->masks.data() + ec_id*N);
+      size_t pos = h & this->mask;
+      while (this->slots[pos] != 0) {
+	pos = (pos + 1) & this->mask;
+      }
+      this->slots[pos] = ((h >> 32) << 32) | (ec_id + 1);
+    }
+  }
+
+public:
+  FixedECTable(const size_t initial_size = 1024) {
+    size_t n_slots = 16;
+    while (n_slots < 2*initial_size) {
+      n_slots <<= 1;
+    }
+    this->slots = std::vector<uint64_t>(n_slots, 0);
+    this->mask = n_slots - 1;
+  }
+
+  // Find the equivalence class of the pattern in `key` or insert it as
+  // a new class. All values in `key` must be less than 64*N.
+  std::pair<uint32_t, bool> insert(const TargetIds &key) {
+    uint64_t words[N] = { 0 };
+    for (size_t i = 0; i < key.size(); ++i) {
+      words[key[i] >> 6] |= 1ULL << (key[i] & 63);
+    }
+
+    uint64_t h = hash(words);
+    uint64_t fingerprint = h >> 32;
+    size_t pos = h & this->mask;
+    while (this->slots[pos] != 0) {
+      ++this->n_probes;
+      uint64_t slot = this->slots[pos];
+      uint32_t ec_id = (slot & 0xFFFFFFFFULL) - 1;
+      if ((slot >> 32) == fingerprint && this->equals(ec_id, words)) {
+	return std::make_pair(ec_id, false);
+      }
+      pos = (pos + 1) & this->mask;
+    }
+    ++this->n_probes;
+
+    uint32_t ec_id = this->size();
+    this->slots[pos] = (fingerprint << 32) | (ec_id + 1);
+    this->masks.insert(this->masks.end(), words, words + N);
+
+    if (2*this->size() > this->slots.size()) {
+      this->grow();
+    }
+    return std::make_pair(ec_id, true);
+  }
+
+  // Number of equivalence classes in the table.
+  size_t size() const { return this->masks.size()/N; }
+
+  // Number of slots examined in insert() so far.
+  size_t probes() const { return this->n_probes; }
+
+  // Sorted targets of the equivalence class `ec_id`, decoded into `buffer`.
+  TargetIds ec_targets(const size_t ec_id, std::vector<uint32_t> *buffer) const {
+    buffer->clear();
+    const uint64_t *words = this->masks.data() + ec_id*N;
+    for (size_t i = 0; i < N; ++i) {
+      uint64_t word = words[i];
+      while (word != 0) {
+	buffer->emplace_back(i*64 + bm::count_trailing_zeros_u64(word));
+	word &= word - 1;
+      }
+    }
+    return TargetIds(buffer->data(), buffer->data() + buffer->size());
+  }
+};
+}
+
+#endif
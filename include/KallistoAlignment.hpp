@@ -34,9 +34,8 @@ struct KallistoRunInfo {
     n_targets = aln.n_targets();
     n_processed = aln.n_reads();
     n_pseudoaligned = 0;
-    n_unique = 0;
+    n_unique = aln.n_unique_reads();
     for (uint32_t i = 0; i < aln.n_ecs(); ++i) {
-      n_unique += (aln.reads_in_ec(i) == 1);
       n_pseudoaligned += aln.reads_in_ec(i);
     }
     p_unique = (double)n_unique/n_processed;
@@ -0,0 +1,219 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#ifndef TELESCOPE_METRICS_HPP
+#define TELESCOPE_METRICS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace telescope {
+// Counters recorded in telescope::Metrics.
+//   `counter_reads_parsed`: reads (aligned + unaligned) read from the input files.
+//   `counter_bytes_read`: bytes read from the input files.
+//   `counter_ecs_created`: equivalence classes created when collapsing.
+//   `counter_hash_probes`: hash table slots examined when collapsing.
+//   `counter_bvector_optimize`: calls to bm::bvector<>::optimize.
+enum metrics_counter { counter_reads_parsed, counter_bytes_read, counter_ecs_created, counter_hash_probes, counter_bvector_optimize, n_metrics_counters };
+
+class Metrics {
+  // telescope::Metrics
+  //
+  // Process-wide timings, peak memory use, and counters of the phases
+  // in reading, merging, collapsing, and writing alignments. Nothing
+  // is recorded until enable() is called. Access through
+  // Metrics::global().
+  //
+private:
+  struct Phase {
+    std::string name;
+    size_t calls;
+    double seconds;
+    size_t peak_rss_kb;
+  };
+
+  std::atomic<bool> enabled;
+  std::array<std::atomic<uint64_t>, n_metrics_counters> counters;
+  std::chrono::time_point<std::chrono::steady_clock> start_time;
+
+  // Phases in the order they were first started.
+  std::vector<Phase> phases;
+
+  // Peak memory use of the phases that are running and of the whole run.
+  std::vector<size_t*> open_peaks;
+  size_t peak_rss_kb;
+
+  std::mutex mutex;
+
+  Metrics() {
+    this->enabled = false;
+    for (size_t i = 0; i < n_metrics_counters; ++i) {
+      this->counters[i] = 0;
+    }
+    this->peak_rss_kb = 0;
+  }
+
+  // Record the peak memory use since the last reset in the running
+  // phases. Caller must hold `mutex`.
+  void update_peaks() {
+    size_t peak = ReadStatus("VmHWM");
+    this->peak_rss_kb = std::max(this->peak_rss_kb, peak);
+    for (size_t *open_peak : this->open_peaks) {
+      *open_peak = std::max(*open_peak, peak);
+    }
+  }
+
+public:
+  Metrics(const Metrics&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+
+  // Value of `field` in /proc/self/status in kB, or 0 if it is not available.
+  static size_t ReadStatus(const std::string &field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+      if (line.compare(0, field.size(), field) == 0 && line.size() > field.size() && line[field.size()] == ':') {
+	return std::stoul(line.substr(field.size() + 1));
+      }
+    }
+    return 0;
+  }
+
+  // Reset the peak resident set size (VmHWM) of the process (Linux only).
+  static void ResetPeakRSS() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs.good()) {
+      clear_refs << "5";
+    }
+  }
+
+  static Metrics& global() {
+    static Metrics metrics;
+    return metrics;
+  }
+
+  void enable() {
+    this->start_time = std::chrono::steady_clock::now();
+    this->enabled = true;
+  }
+  bool is_enabled() const { return this->enabled.load(std::memory_order_relaxed); }
+
+  void add(const metrics_counter counter, const uint64_t value) {
+    if (this->is_enabled()) {
+      this->counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+  }
+  uint64_t counter(const metrics_counter counter) const { return this->counters[counter].load(); }
+
+  // Start tracking the peak memory use of a phase in `peak_rss_kb`.
+  // The peak is reset (Linux only) so that it only covers the time
+  // after this call; the phases that are already running keep their peaks.
+  void start_phase(size_t *peak_rss_kb) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->update_peaks();
+    ResetPeakRSS();
+    *peak_rss_kb = ReadStatus("VmRSS");
+    this->open_peaks.emplace_back(peak_rss_kb);
+  }
+
+  // Record a phase started with start_phase(peak_rss_kb). Phases with
+  // the same name are summed.
+  void end_phase(const std::string &name, const double seconds, size_t *peak_rss_kb) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->update_peaks();
+    this->open_peaks.erase(std::find(this->open_peaks.begin(), this->open_peaks.end(), peak_rss_kb));
+    std::vector<Phase>::iterator phase = std::find_if(this->phases.begin(), this->phases.end(), [&name](const Phase &p) { return p.name == name; });
+    if (phase == this->phases.end()) {
+      this->phases.emplace_back(Phase{ name, 0, 0.0, 0 });
+      phase = this->phases.end() - 1;
+    }
+    phase->calls += 1;
+    phase->seconds += seconds;
+    phase->peak_rss_kb = std::max(phase->peak_rss_kb, *peak_rss_kb);
+  }
+
+  // Write the metrics recorded so far as a json object.
+  void write_json(const uint8_t indent_len, std::ostream *out) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->update_peaks();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - this->start_time;
+    const std::array<std::string, n_metrics_counters> counter_names = { "reads_parsed", "bytes_read", "ecs_created", "hash_probes", "bvector_optimize" };
+
+    std::string indent(indent_len, ' ');
+    *out << "{" << '\n';
+    *out << indent << "\"elapsed_seconds\": " << elapsed.count() << ',' << '\n';
+    *out << indent << "\"peak_rss_kb\": " << this->peak_rss_kb << ',' << '\n';
+    *out << indent << "\"phases\": [" << '\n';
+    for (size_t i = 0; i < this->phases.size(); ++i) {
+      const Phase &phase = this->phases[i];
+      *out << indent << indent << "{ \"name\": \"" << phase.name << "\", \"calls\": " << phase.calls << ", \"seconds\": " << phase.seconds << ", \"peak_rss_kb\": " << phase.peak_rss_kb << " }" << (i + 1 < this->phases.size() ? "," : "") << '\n';
+    }
+    *out << indent << "]," << '\n';
+    *out << indent << "\"counters\": {" << '\n';
+    for (size_t i = 0; i < n_metrics_counters; ++i) {
+      *out << indent << indent << '\"' << counter_names[i] << "\": " << this->counters[i].load() << (i + 1 < n_metrics_counters ? "," : "") << '\n';
+    }
+    *out << indent << "}" << '\n';
+    *out << "}" << '\n';
+    out->flush();
+  }
+};
+
+class ScopedPhase {
+  // telescope::ScopedPhase
+  //
+  // Records the time and peak memory use from construction to
+  // destruction as the phase `name` in Metrics::global(), if enabled.
+  //
+private:
+  const char *name;
+  bool active;
+  size_t peak_rss_kb;
+  std::chrono::time_point<std::chrono::steady_clock> start;
+
+public:
+  ScopedPhase(const char *_name) {
+    this->name = _name;
+    this->active = Metrics::global().is_enabled();
+    if (this->active) {
+      Metrics::global().start_phase(&this->peak_rss_kb);
+      this->start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~ScopedPhase() {
+    if (this->active) {
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - this->start;
+      Metrics::global().end_phase(this->name, elapsed.count(), &this->peak_rss_kb);
+    }
+  }
+
+  ScopedPhase(const ScopedPhase&) = delete;
+  ScopedPhase& operator=(const ScopedPhase&) = delete;
+};
+}
+
+#endif
@@ -0,0 +1,90 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#ifndef TELESCOPE_RADIXSORT_HPP
+#define TELESCOPE_RADIXSORT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+namespace telescope {
+// A 64-bit signature and the record it was computed from.
+struct SignedRecord {
+  uint64_t signature;
+  uint32_t record;
+};
+
+// telescope::RadixSortSignatures
+//
+// Stable least-significant-digit radix sort of `records` by signature
+// using 16-bit digits. Each pass counts the digits of `n_threads`
+// contiguous chunks in parallel and scatters the chunks into a buffer
+// of the same size, so the memory use is twice the size of `records`
+// regardless of the values. Passes where all records share the digit
+// are skipped.
+inline void RadixSortSignatures(std::vector<SignedRecord> *records, size_t n_threads = 1) {
+  constexpr size_t n_buckets = 65536;
+  size_t n_records = records->size();
+  n_threads = std::max((size_t)1, std::min(n_threads, n_records/n_buckets + 1));
+  size_t chunk_size = n_records/n_threads + (n_records % n_threads != 0);
+
+  std::vector<SignedRecord> buffer(n_records);
+  std::vector<std::vector<size_t>> counts(n_threads, std::vector<size_t>(n_buckets));
+  for (size_t shift = 0; shift < 64; shift += 16) {
+#pragma omp parallel for schedule(static, 1) num_threads(n_threads)
+    for (size_t i = 0; i < n_threads; ++i) {
+      std::fill(counts[i].begin(), counts[i].end(), 0);
+      size_t last = std::min((i + 1)*chunk_size, n_records);
+      for (size_t j = std::min(i*chunk_size, n_records); j < last; ++j) {
+	++counts[i][((*records)[j].signature >> shift) & 0xFFFF];
+      }
+    }
+
+    // Turn the counts into the first output position of each digit in
+    // each chunk; digits are ordered before chunks to keep the sort stable.
+    size_t pos = 0;
+    bool trivial = false;
+    for (size_t digit = 0; digit < n_buckets; ++digit) {
+      size_t digit_start = pos;
+      for (size_t i = 0; i < n_threads; ++i) {
+	size_t count = counts[i][digit];
+	counts[i][digit] = pos;
+	pos += count;
+      }
+      trivial = trivial || pos - digit_start == n_records;
+    }
+    if (trivial) {
+      continue;
+    }
+
+#pragma omp parallel for schedule(static, 1) num_threads(n_threads)
+    for (size_t i = 0; i < n_threads; ++i) {
+      size_t last = std::min((i + 1)*chunk_size, n_records);
+      for (size_t j = std::min(i*chunk_size, n_records); j < last; ++j) {
+	const SignedRecord &rec = (*records)[j];
+	buffer[counts[i][(rec.signature >> shift) & 0xFFFF]++] = rec;
+      }
+    }
+    records->swap(buffer);
+  }
+}
+}
+
+#endif
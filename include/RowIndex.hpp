@@ -0,0 +1,168 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#ifndef TELESCOPE_ROWINDEX_HPP
+#define TELESCOPE_ROWINDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "bm64.h"
+
+namespace telescope {
+// telescope::IdRange
+//
+// View into a contiguous range of read or target sequence ids.
+struct IdRange {
+  const uint32_t *first;
+  const uint32_t *last;
+
+  IdRange(const uint32_t *_first, const uint32_t *_last) : first(_first), last(_last) {}
+
+  size_t size() const { return this->last - this->first; }
+  bool empty() const { return this->first == this->last; }
+  uint32_t operator[](const size_t i) const { return this->first[i]; }
+  const uint32_t* begin() const { return this->first; }
+  const uint32_t* end() const { return this->last; }
+};
+
+// Sorted target sequence ids of a read or an equivalence class.
+typedef IdRange TargetIds;
+
+// telescope::ForEachRow
+//
+// Calls `f(row, targets)` for each row in [first_row, last_row) of the
+// `n_cols` wide bit matrix `bits` that has at least one bit set.
+// `targets` contains the sorted column ids of the set bits. The set
+// bits are enumerated block by block so empty rows are skipped without
+// touching their columns.
+template <typename F>
+void ForEachRow(const bm::bvector<> &bits, const size_t n_cols, const size_t first_row, const size_t last_row, F f) {
+  std::vector<uint32_t> targets;
+  size_t current_row = first_row;
+  size_t last_bit = last_row*n_cols;
+
+  bm::bvector<>::enumerator en(&bits, first_row*n_cols);
+  for (; en.valid() && *en < last_bit; ++en) {
+    size_t row = (*en)/n_cols;
+    if (row != current_row && !targets.empty()) {
+      f(current_row, TargetIds(targets.data(), targets.data() + targets.size()));
+      targets.clear();
+    }
+    current_row = row;
+    targets.emplace_back((*en) - row*n_cols);
+  }
+  if (!targets.empty()) {
+    f(current_row, TargetIds(targets.data(), targets.data() + targets.size()));
+  }
+}
+
+// telescope::RowIndex
+//
+// Sparse row-major alignment matrix that stores the sorted target
+// sequence ids of each row contiguously (compressed sparse rows). The
+// cost of visiting a row depends on the number of targets it aligned
+// against rather than on the total number of targets, which makes this
+// cheaper to traverse than the flat bit matrix when there are many
+// reference sequences.
+class RowIndex {
+private:
+  size_t n_refs;
+
+  // Targets of row `i` are stored in
+  // targets[offsets[i]] ... targets[offsets[i + 1] - 1].
+  std::vector<size_t> offsets;
+  std::vector<uint32_t> targets;
+
+public:
+  RowIndex(const size_t _n_refs = 0) {
+    this->n_refs = _n_refs;
+    this->offsets.emplace_back(0);
+  }
+
+  // Build from the `_n_rows` x `_n_refs` bit matrix `bits`.
+  RowIndex(const bm::bvector<> &bits, const size_t _n_refs, const size_t _n_rows) : RowIndex(_n_refs) {
+    this->offsets.reserve(_n_rows + 1);
+    this->targets.reserve(bits.count());
+    ForEachRow(bits, _n_refs, 0, _n_rows, [this](const size_t row, const TargetIds &row_targets) {
+      this->resize(row);
+      this->push_back(row_targets);
+    });
+    this->resize(_n_rows);
+  }
+
+  // Append a row containing the sorted target sequence ids in `row_targets`.
+  void push_back(const TargetIds &row_targets) {
+    this->targets.insert(this->targets.end(), row_targets.begin(), row_targets.end());
+    this->offsets.emplace_back(this->targets.size());
+  }
+
+  // Append the rows of `other`.
+  void append(const RowIndex &other) {
+    size_t n_stored = this->targets.size();
+    this->targets.insert(this->targets.end(), other.targets.begin(), other.targets.end());
+    for (size_t i = 1; i < other.offsets.size(); ++i) {
+      this->offsets.emplace_back(n_stored + other.offsets[i]);
+    }
+  }
+
+  // Append empty rows until there are `_n_rows` rows.
+  void resize(const size_t _n_rows) {
+    if (_n_rows > this->n_rows()) {
+      this->offsets.resize(_n_rows + 1, this->targets.size());
+    }
+  }
+
+  // Get the dimensions of the matrix
+  size_t n_rows() const { return this->offsets.size() - 1; }
+  size_t n_targets() const { return this->n_refs; }
+
+  // Total number of stored target sequence ids.
+  size_t n_nonzero() const { return this->targets.size(); }
+
+  // Get the sorted target sequence ids of `row`.
+  TargetIds operator[](const size_t row) const {
+    return TargetIds(this->targets.data() + this->offsets[row], this->targets.data() + this->offsets[row + 1]);
+  }
+
+  // Check if `row` aligned against `col`.
+  bool operator()(const size_t row, const size_t col) const {
+    const TargetIds &row_targets = (*this)[row];
+    return std::binary_search(row_targets.begin(), row_targets.end(), (uint32_t)col);
+  }
+
+  // Calls `f(row, targets)` for each row in [first_row, last_row) that
+  // aligned against at least one target (same as ForEachRow).
+  template <typename F>
+  void for_each_row(const size_t first_row, const size_t last_row, F f) const {
+    for (size_t row = first_row; row < std::min(last_row, this->n_rows()); ++row) {
+      if (this->offsets[row + 1] > this->offsets[row]) {
+	f(row, (*this)[row]);
+      }
+    }
+  }
+
+  // Get the underlying arrays
+  const std::vector<size_t>& get_offsets() const { return this->offsets; }
+  const std::vector<uint32_t>& get_targets() const { return this->targets; }
+};
+}
+
+#endif
@@ -0,0 +1,47 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#ifndef TELESCOPE_ROWREADER_HPP
+#define TELESCOPE_ROWREADER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace telescope {
+// telescope::RowReader
+//
+// Interface for reading a pseudoalignment one read at a time without
+// storing the whole alignment in memory. Implementations are in
+// `read_themisto_alignments.cpp`.
+class RowReader {
+public:
+  virtual ~RowReader() = default;
+
+  // Read the next aligned read into `read_id` and its sorted target
+  // sequence ids into `targets`. Reads that did not align are skipped.
+  // Returns false once the stream has been exhausted.
+  virtual bool next(size_t *read_id, std::vector<uint32_t> *targets) =0;
+
+  // Total number of reads (unaligned + aligned) in the alignment.
+  // Only guaranteed to be correct after next() has returned false.
+  virtual size_t n_reads() const =0;
+};
+}
+
+#endif
@@ -0,0 +1,178 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#ifndef TELESCOPE_TARGETSUBSET_HPP
+#define TELESCOPE_TARGETSUBSET_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <limits>
+#include <istream>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+#include "bm64.h"
+
+namespace telescope {
+// telescope::TargetSubset
+//
+// Subset of the pseudoalignment targets that is kept when reading an
+// alignment. The kept targets are renumbered 0...n_kept() - 1 in
+// increasing order of their original ids, so the readers can store
+// the alignment with n_kept() columns instead of n_refs() and the
+// sorted targets of a read stay sorted after renumbering.
+class TargetSubset {
+private:
+  size_t n_targets;
+  std::vector<uint32_t> new_ids; // New id of each original target or `dropped`
+  std::vector<uint32_t> kept_ids; // Original id of each kept target
+
+public:
+  static constexpr uint32_t dropped = std::numeric_limits<uint32_t>::max();
+
+  TargetSubset(const size_t _n_refs, const std::vector<uint32_t> &_kept_ids) {
+    this->n_targets = _n_refs;
+    this->kept_ids = _kept_ids;
+    std::sort(this->kept_ids.begin(), this->kept_ids.end());
+    this->kept_ids.erase(std::unique(this->kept_ids.begin(), this->kept_ids.end()), this->kept_ids.end());
+    if (this->kept_ids.empty()) {
+      throw std::runtime_error("No targets selected.");
+    }
+    if (this->kept_ids.back() >= this->n_targets) {
+      throw std::runtime_error("Target sequence " + std::to_string(this->kept_ids.back()) + " is not in the pseudoalignment.");
+    }
+    this->new_ids = std::vector<uint32_t>(this->n_targets, dropped);
+    for (size_t i = 0; i < this->kept_ids.size(); ++i) {
+      this->new_ids[this->kept_ids[i]] = i;
+    }
+  }
+
+  // Get the number of targets in the pseudoalignment and in the subset
+  size_t n_refs() const { return this->n_targets; }
+  size_t n_kept() const { return this->kept_ids.size(); }
+
+  // New id of the original target `target` or `dropped`.
+  uint32_t new_id(const size_t target) const {
+    if (target >= this->n_targets) {
+      throw std::runtime_error("Pseudoalignment file has more target sequences than expected.");
+    }
+    return this->new_ids[target];
+  }
+
+  // Original id of the kept target `target`.
+  uint32_t original_id(const size_t target) const { return this->kept_ids[target]; }
+
+  // Renumber the sorted targets of a read in place and remove the
+  // targets that are not kept.
+  void project(std::vector<uint32_t> *targets) const {
+    size_t n_kept_targets = 0;
+    for (size_t i = 0; i < targets->size(); ++i) {
+      uint32_t target = this->new_id((*targets)[i]);
+      if (target != dropped) {
+	(*targets)[n_kept_targets] = target;
+	++n_kept_targets;
+      }
+    }
+    targets->resize(n_kept_targets);
+  }
+
+  // Copy the kept targets from the alignment `full` with n_refs()
+  // columns into `projected` with n_kept() columns.
+  void project(const bm::bvector<> &full, bm::bvector<> *projected) const {
+    bm::bvector<>::bulk_insert_iterator it(*projected);
+    for (bm::bvector<>::enumerator en = full.first(); en.valid(); ++en) {
+      size_t read_id = (*en)/this->n_targets;
+      uint32_t target = this->new_ids[*en - read_id*this->n_targets];
+      if (target != dropped) {
+	*it = read_id*this->kept_ids.size() + target;
+      }
+    }
+  }
+};
+
+namespace read {
+// telescope::read::TargetList
+//
+// Read the ids (0-based) of the kept targets from a file that has
+// one id per line.
+//
+// Input:
+//   `n_refs`: number of pseudoalignment targets (reference sequences).
+//   `stream`: pointer to an istream opened on the target list.
+// Output:
+//   `subset`: the listed targets.
+inline TargetSubset TargetList(const size_t n_refs, std::istream *stream) {
+  std::vector<uint32_t> kept_ids;
+  std::string line;
+  while (std::getline(*stream, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty()) {
+      continue;
+    }
+    unsigned long long target;
+    try {
+      target = std::stoull(line);
+    } catch (const std::exception &) {
+      throw std::runtime_error("Target list has a line that is not a target sequence id: " + line);
+    }
+    if (target >= n_refs || target > std::numeric_limits<uint32_t>::max()) {
+      throw std::runtime_error("Target sequence " + line + " is not in the pseudoalignment.");
+    }
+    kept_ids.emplace_back(target);
+  }
+  return TargetSubset(n_refs, kept_ids);
+}
+
+// telescope::read::TargetGroups
+//
+// Keep the targets that belong to one of the groups in `groups`.
+//
+// Input:
+//   `n_refs`: number of pseudoalignment targets (reference sequences).
+//   `stream`: pointer to an istream opened on a file that contains
+//             the group of the n:th target on the n:th line.
+//   `groups`: names of the kept groups.
+// Output:
+//   `subset`: the targets in `groups`.
+inline TargetSubset TargetGroups(const size_t n_refs, std::istream *stream, const std::vector<std::string> &groups) {
+  std::vector<uint32_t> kept_ids;
+  std::string line;
+  size_t n_lines = 0;
+  while (std::getline(*stream, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (std::find(groups.begin(), groups.end(), line) != groups.end()) {
+      kept_ids.emplace_back(n_lines);
+    }
+    ++n_lines;
+  }
+  if (n_lines != n_refs) {
+    throw std::runtime_error("Group file has " + std::to_string(n_lines) + " lines but the pseudoalignment has " + std::to_string(n_refs) + " target sequences.");
+  }
+  return TargetSubset(n_refs, kept_ids);
+}
+}
+}
+
+#endif
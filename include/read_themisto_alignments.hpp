@@ -21,33 +21,152 @@
 
 #include <cstddef>
 #include <vector>
+#include <charconv>
+#include <system_error>
 #include <fstream>
 #include <memory>
 #include <set>
+#include <stdexcept>
 
 #include "Alignment.hpp"
+#include "ECConsumer.hpp"
 #include "KallistoAlignment.hpp"
+#include "RowReader.hpp"
+#include "TargetSubset.hpp"
 
 namespace telescope {
+// Merge operation for alignment files from different sequencing lanes
+// of the same sample. The files are concatenated so that the reads of
+// the n:th file get the read ids after the reads of the (n - 1):th
+// file. BitMagic has no such set operation so this is not one of its
+// values.
+constexpr bm::set_operation set_concatenate = bm::set_END;
+
 // telescope::ReadPairedAlignments
 //
 // Reads one or more pseudoalignment files from Themisto for
 // paired reads into `ec_configs`. Can be in plaintext or alignment-writer
 // format. Returns the number of reads (unaligned + aligned) in the
-// alignment.
+// alignment. The first file is read into `ec_configs` and the others
+// are merged into it one window of reads or alignment-writer chunk at
+// a time, so only one full alignment is stored in memory. With more
+// than two files and more than one thread, up to `n_threads` files
+// are merged concurrently.
 //
 // Input:
-//   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of multiple alignmnet files
+//   `merge_op`: bm::set_OR for union, bm::set_AND for intersection, or set_concatenate
+//               for concatenation (see ConcatenateAlignmentFiles) of multiple alignmnet files
 //   `n_targets`: number of pseudoalignment targets (reference
 //                sequences). It's not possible to infer this from the plaintext Themisto
 //                file format so has to be provided separately. If the file is in the
 //                compact format will check that the numbers match.
 //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
 //   `ec_configs`: pointer to the output variable that will contain the alignment.
+//   `n_threads`: number of threads to use (default: 1). Chunks in alignment-writer
+//                files are deserialized in parallel.
+//   `file_seconds`: if not nullptr, set to the time spent reading each file (default: nullptr).
+//   `subset`: if not nullptr, keep only the targets in `subset` and store them with their
+//             ids in the subset, so `ec_configs` has `subset->n_kept()` columns (default: nullptr).
 // Output:
 //   `n_reads`: total number of reads in the pseudoalignment (unaligned + aligned).
 //
-size_t ReadPairedAlignments(const bm::set_operation &merge_op, const size_t n_targets, std::vector<std::istream*> &streams, bm::bvector<> *ec_configs);
+size_t ReadPairedAlignments(const bm::set_operation &merge_op, const size_t n_targets, std::vector<std::istream*> &streams, bm::bvector<> *ec_configs, const size_t n_threads = 1, std::vector<double> *file_seconds = nullptr, const TargetSubset *subset = nullptr);
+
+// telescope::ConcatenateAlignmentFiles
+//
+// Reads pseudoalignment files from Themisto for different sequencing
+// lanes of the same sample into one alignment in `ec_configs`. Each
+// file is read into its own alignment, with up to `n_threads` files
+// read concurrently, and the alignments are then spliced together so
+// that read `j` of file `i` gets the read id `lane_offsets[i] + j`.
+// The files can have different numbers of reads and can be in any mix
+// of the plaintext and alignment-writer formats. Returns the number of
+// reads (unaligned + aligned) in all of the files.
+//
+// Input:
+//   `n_targets`: number of pseudoalignment targets (reference sequences).
+//   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+//   `ec_configs`: pointer to the output variable that will contain the alignment.
+//   `n_threads`: number of threads to use (default: 1).
+//   `lane_offsets`: if not nullptr, set to the first read id of each file followed by
+//                   the total number of reads (default: nullptr).
+//   `file_seconds`: if not nullptr, set to the time spent reading each file (default: nullptr).
+//   `subset`: if not nullptr, keep only the targets in `subset` (see ReadPairedAlignments).
+// Output:
+//   `n_reads`: total number of reads in the pseudoalignment (unaligned + aligned).
+//
+size_t ConcatenateAlignmentFiles(const size_t n_targets, std::vector<std::istream*> &streams, bm::bvector<> *ec_configs, const size_t n_threads = 1, std::vector<size_t> *lane_offsets = nullptr, std::vector<double> *file_seconds = nullptr, const TargetSubset *subset = nullptr);
+
+// telescope::ParsePlaintextLine
+//
+// Parses a line in a plaintext alignment file from Themisto
+// (https://github.com/algbio/themisto). The line should contain the
+// read id followed by the target sequence ids, separated by spaces.
+// Returns false if the line is not in this format.
+//
+// Input:
+//   `begin`, `end`: start and end of the line without the line break.
+//   `read_id`: set to the read id (0-based indexing).
+//   `insert_target`: called with each target sequence id (0-based indexing).
+//
+template <typename F>
+bool ParsePlaintextLine(const char *begin, const char *end, size_t *read_id, F insert_target) {
+  if (begin != end && *(end - 1) == '\r') {
+    --end;
+  }
+  std::from_chars_result res = std::from_chars(begin, end, *read_id);
+  if (res.ec != std::errc()) {
+    return false;
+  }
+  const char *pos = res.ptr;
+  while (pos != end) {
+    if (*pos != ' ') {
+      return false;
+    }
+    while (pos != end && *pos == ' ') {
+      ++pos;
+    }
+    if (pos == end) {
+      break;
+    }
+    size_t target;
+    res = std::from_chars(pos, end, target);
+    if (res.ec != std::errc()) {
+      return false;
+    }
+    insert_target(target);
+    pos = res.ptr;
+  }
+  return true;
+}
+
+// telescope::StreamPairedAlignments
+//
+// Opens one or more pseudoalignment files from Themisto for paired
+// reads for reading one read at a time. The files are merged record by
+// record so the full alignment is never stored in memory. Can be in
+// plaintext or alignment-writer format. When there is more than one
+// file, the reads in each file must be sorted by read id unless the
+// files are concatenated.
+//
+// Input:
+//   `merge_op`: bm::set_OR for union, bm::set_AND for intersection, or set_concatenate
+//               for concatenation of multiple alignmnet files
+//   `n_targets`: number of pseudoalignment targets (reference
+//                sequences). It's not possible to infer this from the plaintext Themisto
+//                file format so has to be provided separately. If the file is in the
+//                compact format will check that the numbers match.
+//   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+//   `n_threads`: read each file on a separate thread if > 1 (default: 1).
+//   `subset`: if not nullptr, return only the targets in `subset` with their ids in the
+//             subset and skip the reads that align to none of them (default: nullptr).
+//   `lane_offsets`: with set_concatenate, if not nullptr, set to the first read id of each
+//                   file followed by the total number of reads once the reader has been
+//                   exhausted (default: nullptr).
+// Output:
+//   `reader`: RowReader returning the merged reads.
+//
+std::unique_ptr<RowReader> StreamPairedAlignments(const bm::set_operation &merge_op, const size_t n_targets, std::vector<std::istream*> &streams, const size_t n_threads = 1, const TargetSubset *subset = nullptr, std::vector<size_t> *lane_offsets = nullptr);
 
 template<typename T>
 size_t get_max_size(const std::vector<T> &group_indicators, const size_t n_groups) {
@@ -72,15 +191,48 @@ namespace read {
 // sequences are assigned to the same equivalence class.
 //
 // Input:
-//   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of multiple alignmnet files
+//   `merge_op`: bm::set_OR for union, bm::set_AND for intersection, or set_concatenate for
+//               concatenation of multiple alignmnet files. Concatenated alignments store the
+//               first read id of each file (see ThemistoAlignment::get_lane_offsets).
 //   `n_refs`: number of pseudoalignment targets (reference
 //                sequences). It's not possible to infer this from the plaintext Themisto
 //                file format so has to be provided separately. If the file is in the
 //                compact format will check that the numbers match.
 //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+//   `engine`: algorithm used to collapse the alignment (default: collapse_hash).
+//   `n_threads`: number of threads to use in reading and collapsing the alignment (default: 1).
+//   `store_read_ids`: store the IDs of the reads assigned to each equivalence class (default: true).
+//   `subset`: if not nullptr, keep only the targets in `subset`. The alignment then has
+//             `subset->n_kept()` targets numbered by their ids in the subset (default: nullptr).
 // Output:
 //   `aln`: The pseudoalignment as a telescope::ThemistoAlignment object.
-ThemistoAlignment Themisto(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams);
+ThemistoAlignment Themisto(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams, const collapse_engine engine = collapse_hash, const size_t n_threads = 1, const bool store_read_ids = true, const TargetSubset *subset = nullptr);
+
+// telescope::read::ThemistoToConsumer
+//
+// Read in a Themisto pseudoalignment and pass each equivalence class
+// and read assignment to `consumer` as they are created (see
+// ECConsumer.hpp). The read assignments are not stored in the returned
+// alignment, and with `collapse_stream` the full alignment is never
+// stored either.
+//
+// Input:
+//   `merge_op`: bm::set_OR for union, bm::set_AND for intersection, or set_concatenate for
+//               concatenation of multiple alignmnet files. Concatenated alignments store the
+//               first read id of each file (see ThemistoAlignment::get_lane_offsets).
+//   `n_refs`: number of pseudoalignment targets (reference
+//                sequences). It's not possible to infer this from the plaintext Themisto
+//                file format so has to be provided separately. If the file is in the
+//                compact format will check that the numbers match.
+//   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+//   `consumer`: receives the equivalence classes and read assignments.
+//   `engine`: algorithm used to collapse the alignment (default: collapse_stream).
+//   `n_threads`: number of threads to use in reading and collapsing the alignment (default: 1).
+//   `subset`: if not nullptr, keep only the targets in `subset`. The alignment then has
+//             `subset->n_kept()` targets numbered by their ids in the subset (default: nullptr).
+// Output:
+//   `aln`: The equivalence classes and their counts as a telescope::ThemistoAlignment object.
+ThemistoAlignment ThemistoToConsumer(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams, ECConsumer *consumer, const collapse_engine engine = collapse_stream, const size_t n_threads = 1, const TargetSubset *subset = nullptr);
 
 // telescope::read::ThemistoPlain
 //
@@ -88,15 +240,20 @@ ThemistoAlignment Themisto(const bm::set_operation &merge_op, const size_t n_ref
 // i. e. without collapsing it into equivalence classes.
 //
 // Input:
-//   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of multiple alignmnet files
+//   `merge_op`: bm::set_OR for union, bm::set_AND for intersection, or set_concatenate for
+//               concatenation of multiple alignmnet files
 //   `n_refs`: number of pseudoalignment targets (reference
 //                sequences). It's not possible to infer this from the plaintext Themisto
 //                file format so has to be provided separately. If the file is in the
 //                compact format will check that the numbers match.
 //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+//   `n_threads`: number of threads to use in reading the alignment (default: 1).
+//   `file_seconds`: if not nullptr, set to the time spent reading each file (default: nullptr).
+//   `subset`: if not nullptr, keep only the targets in `subset`. The alignment then has
+//             `subset->n_kept()` targets numbered by their ids in the subset (default: nullptr).
 // Output:
 //   `aln`: The pseudoalignment as a telescope::ThemistoAlignment object.
-ThemistoAlignment ThemistoPlain(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams);
+ThemistoAlignment ThemistoPlain(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams, const size_t n_threads = 1, std::vector<double> *file_seconds = nullptr, const TargetSubset *subset = nullptr);
 
 // telescope::read::ThemistoGrouped
 //
@@ -117,18 +274,22 @@ ThemistoAlignment ThemistoPlain(const bm::set_operation &merge_op, const size_t
 //   `group_indicators`: Vector assigning each reference sequence to a reference group. The group
 //                       of the n:th sequence is the value at the (n - 1):th position in the vector.
 //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
-// Output:
-//   `aln`: The pseudoalignment as a telescope::GroupedAlignment object.
-//   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+//   `engine`: algorithm used to collapse the alignment (default: collapse_hash).
+//   `n_threads`: number of threads to use in reading and collapsing the alignment (default: 1).
+//   `store_read_ids`: store the IDs of the reads assigned to each equivalence class (default: true).
+//   `collapse_on_groups`: assign reads that aligned against the same number of reference sequences
+//                         in each group to the same equivalence class, instead of reads that aligned
+//                         against the same reference sequences (default: false). Not supported by
+//                         `collapse_legacy`; throws if both are given.
 // Output:
 //   `aln`: The pseudoalignment as a telescope::GroupedAlignment object.
 //
 template<typename T>
-void ThemistoGrouped(const bm::set_operation &merge_op, const size_t n_refs, const std::vector<T> &group_indicators, std::vector<std::istream*> &streams, std::unique_ptr<Alignment> &aln) {
-      //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
-  // Output:
-  //   `aln`: The pseudoalignment as a telescope::GroupedAlignment object.
-  //
+void ThemistoGrouped(const bm::set_operation &merge_op, const size_t n_refs, const std::vector<T> &group_indicators, std::vector<std::istream*> &streams, std::unique_ptr<Alignment> &aln, const collapse_engine engine = collapse_hash, const size_t n_threads = 1, const bool store_read_ids = true, const bool collapse_on_groups = false) {
+  if (collapse_on_groups && engine == collapse_legacy) {
+    // The legacy engine always collapses on the aligned targets.
+    throw std::runtime_error("Collapsing on groups is not supported with the legacy collapse engine.");
+  }
 
   // Count the number of distinct reference groups
   std::set<T> reference_group_ids;
@@ -140,18 +301,29 @@ void ThemistoGrouped(const bm::set_operation &merge_op, const size_t n_refs, con
 
   // Read the alignment
   bm::bvector<> ec_configs(bm::BM_GAP);
-  size_t n_reads = ReadPairedAlignments(merge_op, n_refs, streams, &ec_configs);
+  std::unique_ptr<RowReader> reader;
+  size_t n_reads = 0;
+  if (engine == collapse_stream) {
+    reader = StreamPairedAlignments(merge_op, n_refs, streams, n_threads);
+  } else {
+    n_reads = ReadPairedAlignments(merge_op, n_refs, streams, &ec_configs, n_threads);
+  }
 
   if (max_size <= std::numeric_limits<uint8_t>::max()) {
-    aln.reset(new GroupedAlignment<uint8_t, T>(n_refs, n_groups, n_reads, group_indicators));
+    aln.reset(new GroupedAlignment<uint8_t, T>(n_refs, n_groups, n_reads, group_indicators, collapse_on_groups));
   } else if (max_size <= std::numeric_limits<uint16_t>::max()) {
-    aln.reset(new GroupedAlignment<uint16_t, T>(n_refs, n_groups, n_reads, group_indicators));
+    aln.reset(new GroupedAlignment<uint16_t, T>(n_refs, n_groups, n_reads, group_indicators, collapse_on_groups));
   } else if (max_size <= std::numeric_limits<uint32_t>::max()) {
-    aln.reset(new GroupedAlignment<uint32_t, T>(n_refs, n_groups, n_reads, group_indicators));
+    aln.reset(new GroupedAlignment<uint32_t, T>(n_refs, n_groups, n_reads, group_indicators, collapse_on_groups));
   } else {
-    aln.reset(new GroupedAlignment<uint64_t, T>(n_refs, n_groups, n_reads, group_indicators));
+    aln.reset(new GroupedAlignment<uint64_t, T>(n_refs, n_groups, n_reads, group_indicators, collapse_on_groups));
+  }
+  aln->set_store_read_ids(store_read_ids);
+  if (reader) {
+    aln->collapse(*reader);
+  } else {
+    aln->collapse(ec_configs, engine, n_threads);
   }
-  aln->collapse(ec_configs);
 }
 
 // telescope::read::ThemistoToKallisto
@@ -159,15 +331,22 @@ void ThemistoGrouped(const bm::set_operation &merge_op, const size_t n_refs, con
 // Read in a Themisto pseudoalignment and convert it into a Kallisto pseudoalignment.
 //
 // Input:
-//   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of multiple alignmnet files
+//   `merge_op`: bm::set_OR for union, bm::set_AND for intersection, or set_concatenate for
+//               concatenation of multiple alignmnet files. Concatenated alignments store the
+//               first read id of each file (see ThemistoAlignment::get_lane_offsets).
 //   `n_refs`: number of pseudoalignment targets (reference
 //                sequences). It's not possible to infer this from the plaintext Themisto
 //                file format so has to be provided separately. If the file is in the
 //                compact format will check that the numbers match.
 //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+//   `engine`: algorithm used to collapse the alignment (default: collapse_hash).
+//   `n_threads`: number of threads to use in reading and collapsing the alignment (default: 1).
+//   `store_read_ids`: store the IDs of the reads assigned to each equivalence class (default: true).
+//   `subset`: if not nullptr, keep only the targets in `subset`. The alignment then has
+//             `subset->n_kept()` targets numbered by their ids in the subset (default: nullptr).
 // Output:
 //   `aln`: The pseudoalignment as a telescope::KallistoAlignment object.
-KallistoAlignment ThemistoToKallisto(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams);
+KallistoAlignment ThemistoToKallisto(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams, const collapse_engine engine = collapse_hash, const size_t n_threads = 1, const bool store_read_ids = true, const TargetSubset *subset = nullptr);
 
 }
 }
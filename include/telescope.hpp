@@ -29,10 +29,15 @@
 #include "read_themisto_alignments.hpp"
 #include "Alignment.hpp"
 #include "KallistoAlignment.hpp"
+#include "ECIndex.hpp"
+#include "ECConsumer.hpp"
+#include "Metrics.hpp"
+#include "AlignmentCache.hpp"
+#include "TargetSubset.hpp"
 
 namespace telescope {
 namespace read {
-  // Check `read_themisto_alignments.hpp`
+  // Check `read_themisto_alignments.hpp` and `ECIndex.hpp`
 }
 
 namespace write {
@@ -51,12 +56,36 @@ void ThemistoToKallisto(const ThemistoAlignment &aln, std::ostream* ec_file, std
 // telescope::write::ThemistoReadAssignments
 //
 // Writes the alignment of each read against the reference sequences.
+// Reads in an alignment concatenated from several files are written as
+// <file>:<read id in the file>.
 //
 // Input:
 //   `aln`: The pseudoalignment to write.
 //   `out`: Pointer to the output file stream.
 void ThemistoReadAssignments(const ThemistoAlignment &aln, std::ostream* out);
 
+// telescope::write::ThemistoPlaintext
+//
+// Writes the alignment contained in `aln` in the plaintext Themisto
+// format. Ranges of reads are formatted in parallel and written in order.
+//
+// Input:
+//   `aln`: The pseudoalignment to write (not collapsed).
+//   `out`: Pointer to the output file stream.
+//   `n_threads`: Number of threads to use in formatting the output (default: 1).
+void ThemistoPlaintext(const ThemistoAlignment &aln, std::ostream* out, const size_t n_threads = 1);
+
+// telescope::write::ECIndexFile
+//
+// Writes the equivalence classes, their counts, and the reads assigned
+// to them as a binary index that can be memory-mapped with
+// telescope::read::ECIndexFile (format described in `ECIndex.hpp`).
+//
+// Input:
+//   `aln`: The collapsed pseudoalignment to write.
+//   `out`: Pointer to the output file stream (opened in binary mode).
+void ECIndexFile(const ThemistoAlignment &aln, std::ostream* out);
+
 // telescope::write::KallistoInfoFile
 //
 // Writes the Kallisto run_info.json file from the `run_info` object.
@@ -66,6 +95,16 @@ void ThemistoReadAssignments(const ThemistoAlignment &aln, std::ostream* out);
 //   `indent_len`: Indent length in the written json file.
 //   `out`: Pointer to a file stream to write into.
 void KallistoInfoFile(const KallistoRunInfo &run_info, const uint8_t indent_len, std::ostream *out);
+
+// telescope::write::TargetSubsetIds
+//
+// Writes the original id of each target sequence kept in `subset`,
+// one per line in the order of their ids in the subset.
+//
+// Input:
+//   `subset`: The kept target sequences.
+//   `out`: Pointer to a file stream to write into.
+void TargetSubsetIds(const TargetSubset &subset, std::ostream *out);
 }
 
 // telescope::get_mode returns the correct set operation for merging
@@ -75,8 +114,20 @@ inline bm::set_operation get_mode(const std::string &mode_str) {
   // Get the paired reads merge mode based on command line argument
   if (mode_str == "union") return bm::set_OR;
   if (mode_str == "intersection") return bm::set_AND;
+  if (mode_str == "concatenate") return set_concatenate;
   throw std::runtime_error("Unrecognized paired-end mode.");
 }
+
+// telescope::get_collapse_engine returns the algorithm used for
+// collapsing the alignment into equivalence classes. The return value
+// is used as an argument to the telescope::read functions.
+inline collapse_engine get_collapse_engine(const std::string &engine_str) {
+  if (engine_str == "hash") return collapse_hash;
+  if (engine_str == "legacy") return collapse_legacy;
+  if (engine_str == "stream") return collapse_stream;
+  if (engine_str == "sort") return collapse_sort;
+  throw std::runtime_error("Unrecognized collapse engine.");
+}
 }
 
 namespace cxxargs {
@@ -87,6 +138,14 @@ inline std::istream& operator>> (std::istream &in, bm::set_operation &t) {
   t = telescope::get_mode(in_val);
   return in;
 }
+
+// Define the cxxargs operator for reading a command-line argument as a telescope::collapse_engine.
+inline std::istream& operator>> (std::istream &in, telescope::collapse_engine &t) {
+  std::string in_val;
+  in >> in_val;
+  t = telescope::get_collapse_engine(in_val);
+  return in;
+}
 }
 
 #endif
@@ -0,0 +1,201 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#include "AlignmentCache.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "telescope.hpp"
+
+namespace telescope {
+// Bytes read from the start, middle, and end of each input file.
+constexpr size_t cache_sample_size = 65536;
+
+void HashBytes(const char *bytes, const size_t n_bytes, uint64_t *h1, uint64_t *h2) {
+  // telescope::HashBytes
+  //
+  // Updates two independent 64-bit FNV-1a style hashes `h1` and `h2`
+  // with `n_bytes` bytes from `bytes`.
+  //
+  for (size_t i = 0; i < n_bytes; ++i) {
+    *h1 = (*h1 ^ (unsigned char)bytes[i])*0x100000001B3ULL;
+    *h2 = ((*h2 ^ (unsigned char)bytes[i]) + 0x9E3779B97F4A7C15ULL)*0xBF58476D1CE4E5B9ULL;
+  }
+}
+
+std::string ToHex(const uint64_t value) {
+  char hex[17];
+  std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)value);
+  return std::string(hex);
+}
+
+AlignmentCache::AlignmentCache(const std::string &_dir, const size_t _max_bytes) {
+  this->dir = _dir;
+  this->max_bytes = _max_bytes;
+  if (mkdir(this->dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw std::runtime_error("Could not create the cache directory " + this->dir + ".");
+  }
+}
+
+std::string AlignmentCache::key(const std::vector<std::string> &paths, const size_t n_refs, const bm::set_operation &merge_op, const bool store_read_ids, const TargetSubset *subset) const {
+  uint64_t h1 = 0xCBF29CE484222325ULL;
+  uint64_t h2 = 0x84222325CBF29CE4ULL;
+  const std::string &settings = std::to_string(ec_index_version) + ',' + std::to_string(n_refs) + ',' + std::to_string((int)merge_op) + ',' + std::to_string(store_read_ids);
+  HashBytes(settings.data(), settings.size(), &h1, &h2);
+  if (subset != nullptr) {
+    std::string kept_ids = ";targets";
+    for (size_t i = 0; i < subset->n_kept(); ++i) {
+      kept_ids += ',' + std::to_string(subset->original_id(i));
+    }
+    HashBytes(kept_ids.data(), kept_ids.size(), &h1, &h2);
+  }
+
+  std::vector<char> sample(cache_sample_size);
+  for (const std::string &path : paths) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      if (fd != -1) {
+	close(fd);
+      }
+      throw std::runtime_error("File " + path + " is not accessible.");
+    }
+    const std::string &file_info = ';' + std::to_string(st.st_size) + ',' + std::to_string(st.st_mtim.tv_sec) + '.' + std::to_string(st.st_mtim.tv_nsec);
+    HashBytes(file_info.data(), file_info.size(), &h1, &h2);
+
+    size_t file_size = st.st_size;
+    size_t last_sample = (file_size > cache_sample_size ? file_size - cache_sample_size : 0);
+    for (const size_t offset : { (size_t)0, last_sample/2, last_sample }) {
+      ssize_t n_bytes = pread(fd, sample.data(), cache_sample_size, offset);
+      if (n_bytes > 0) {
+	HashBytes(sample.data(), n_bytes, &h1, &h2);
+      }
+    }
+    close(fd);
+  }
+  return ToHex(h1) + ToHex(h2);
+}
+
+bool AlignmentCache::load(const std::string &key, const size_t n_refs, ThemistoAlignment *aln) const {
+  ScopedPhase phase("cache_load");
+  const std::string &path = this->entry_path(key);
+  if (access(path.c_str(), R_OK) != 0) {
+    return false;
+  }
+  try {
+    const ECIndex &index = read::ECIndexFile(path);
+    if (index.n_targets() != n_refs) {
+      return false;
+    }
+    RowIndex ec_targets(n_refs);
+    std::vector<uint32_t> ec_counts(index.n_ecs());
+    for (size_t i = 0; i < index.n_ecs(); ++i) {
+      ec_targets.push_back(TargetIds(index.ec_begin(i), index.ec_end(i)));
+      ec_counts[i] = index.reads_in_ec(i);
+    }
+    std::vector<size_t> aligned_reads_offsets;
+    std::vector<uint32_t> aligned_reads;
+    if (index.n_aligned_reads() > 0) {
+      aligned_reads.reserve(index.n_aligned_reads());
+      aligned_reads_offsets.emplace_back(0);
+      for (size_t i = 0; i < index.n_ecs(); ++i) {
+	const ReadIds &reads = index.reads_assigned_to_ec(i);
+	if (std::any_of(reads.begin(), reads.end(), [&index](const uint32_t read_id) { return read_id >= index.n_reads(); })) {
+	  throw std::runtime_error("Cache entry " + path + " has a read id that is out of range.");
+	}
+	aligned_reads.insert(aligned_reads.end(), reads.begin(), reads.end());
+	aligned_reads_offsets.emplace_back(aligned_reads.size());
+      }
+    }
+    *aln = ThemistoAlignment(index.n_reads(), std::move(ec_targets), std::move(ec_counts), std::move(aligned_reads_offsets), std::move(aligned_reads));
+  } catch (const std::exception &) {
+    // Unreadable or corrupt entries (ECIndex validates the offsets and
+    // target ids) are treated as missing and replaced by store().
+    return false;
+  }
+  // Mark the entry as recently used.
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+  return true;
+}
+
+void AlignmentCache::store(const std::string &key, const ThemistoAlignment &aln) const {
+  ScopedPhase phase("cache_store");
+  const std::string &path = this->entry_path(key);
+  const std::string &tmp_path = path + '.' + std::to_string(getpid()) + ".tmp";
+  {
+    std::ofstream out(tmp_path, std::ios::binary);
+    if (!out.good()) {
+      throw std::runtime_error("Could not write to the cache directory " + this->dir + ".");
+    }
+    try {
+      write::ECIndexFile(aln, &out);
+    } catch (const std::exception &) {
+      std::remove(tmp_path.c_str());
+      throw;
+    }
+  }
+  // Concurrent runs see either the complete entry or no entry.
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    throw std::runtime_error("Could not write to the cache directory " + this->dir + ".");
+  }
+  this->evict();
+}
+
+void AlignmentCache::evict() const {
+  std::vector<std::pair<int64_t, std::string>> entries; // Last use time and path of each entry
+  size_t total_bytes = 0;
+  DIR *handle = opendir(this->dir.c_str());
+  if (handle == nullptr) {
+    return;
+  }
+  while (struct dirent *entry = readdir(handle)) {
+    const std::string name(entry->d_name);
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".idx") == 0) {
+      const std::string &path = this->dir + "/" + name;
+      struct stat st;
+      if (stat(path.c_str(), &st) == 0) {
+	entries.emplace_back((int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec, path);
+	total_bytes += st.st_size;
+      }
+    }
+  }
+  closedir(handle);
+
+  std::sort(entries.begin(), entries.end());
+  for (size_t i = 0; i < entries.size() && total_bytes > this->max_bytes; ++i) {
+    struct stat st;
+    if (stat(entries[i].second.c_str(), &st) == 0 && std::remove(entries[i].second.c_str()) == 0) {
+      total_bytes -= st.st_size;
+    }
+  }
+}
+}
@@ -19,17 +19,51 @@
 #include "read_themisto_alignments.hpp"
 
 #include <string>
-#include <sstream>
 #include <set>
 #include <limits>
+#include <algorithm>
+#include <iterator>
+#include <charconv>
+#include <cstring>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 
 #include "bm64.h"
+#include "bmserial.h"
 #include "unpack.hpp"
 
 #include "telescope.hpp"
 
 namespace telescope {
-void ReadCompactAlignment(std::istream *stream, bm::bvector<> *ec_configs) {
+std::unique_lock<std::mutex> LockIf(std::mutex *lock) {
+  // telescope::LockIf
+  //
+  // Locks `lock` for the lifetime of the returned object, or does
+  // nothing if `lock` is nullptr.
+  //
+  return (lock == nullptr ? std::unique_lock<std::mutex>() : std::unique_lock<std::mutex>(*lock));
+}
+
+void DeserializeChunk(const unsigned char *buffer, const TargetSubset *subset, bm::bvector<> *chunk) {
+  // telescope::DeserializeChunk
+  //
+  // Deserializes a chunk from an alignment-writer file into `chunk`,
+  // keeping only the targets in `subset` if it is not nullptr.
+  //
+  if (subset == nullptr) {
+    bm::deserialize(*chunk, buffer);
+  } else {
+    bm::bvector<> full(bm::BM_GAP);
+    bm::deserialize(full, buffer);
+    subset->project(full, chunk);
+  }
+}
+
+void ReadCompactAlignment(std::istream *stream, bm::bvector<> *ec_configs, const TargetSubset *subset) {
   // telescope::ReadCompactAlignment
   //
   // Reads an alignment file that has been compacted with
@@ -40,16 +74,255 @@ void ReadCompactAlignment(std::istream *stream, bm::bvector<> *ec_configs) {
   //   `stream`: pointer to an istream opened on the pseudoalignment file.
   //     NOTE:   Use alignment_writer::ReadHeader before calling this function!
   //   `ec_configs`: pointer to the output variable that will contain the alignment.
+  //   `subset`: targets to keep (or nullptr to keep all).
   //
+  size_t n_bits = ec_configs->size();
   std::string line;
+  size_t n_bytes = 0;
+  std::vector<unsigned char> buffer;
+  bm::bvector<> chunk(bm::BM_GAP);
   while (std::getline(*stream, line)) {
     // Deserialize each chunk in the file by ORing into ec_configs
     size_t next_buffer_size = std::stoul(line);
-    alignment_writer::DeserializeBuffer(next_buffer_size, stream, ec_configs);
+    if (subset == nullptr) {
+      alignment_writer::DeserializeBuffer(next_buffer_size, stream, ec_configs);
+    } else {
+      // Only the current chunk is stored with all of the targets.
+      buffer.resize(next_buffer_size);
+      stream->read(reinterpret_cast<char*>(buffer.data()), next_buffer_size);
+      DeserializeChunk(buffer.data(), subset, &chunk);
+      ec_configs->merge(chunk);
+      chunk.clear(true);
+    }
+    n_bytes += line.size() + 1 + next_buffer_size;
   }
+  ec_configs->resize(n_bits);
+  Metrics::global().add(counter_bytes_read, n_bytes);
 }
 
-void ReadPlaintextLine(const size_t n_targets, std::string &line, bm::bvector<>::bulk_insert_iterator &it) {
+void ReadCompactAlignment(std::istream *stream, const size_t n_threads, bm::bvector<> *ec_configs, const TargetSubset *subset) {
+  // telescope::ReadCompactAlignment
+  //
+  // Reads an alignment file that has been compacted with
+  // alignment-writer (https://github.com/tmaklin/alignment-writer)
+  // into `*ec_configs` by deserializing the chunks in the file in
+  // parallel.
+  //
+  // Input:
+  //   `stream`: pointer to an istream opened on the pseudoalignment file.
+  //     NOTE:   Use alignment_writer::ReadHeader before calling this function!
+  //   `n_threads`: number of threads to use.
+  //   `ec_configs`: pointer to the output variable that will contain the alignment.
+  //   `subset`: targets to keep (or nullptr to keep all).
+  //
+  size_t n_bits = ec_configs->size();
+
+  // Read the serialized chunks in batches and deserialize each batch
+  // in parallel, so at most `batch_size` chunks are in memory at once.
+  size_t batch_size = 4*n_threads;
+  std::vector<std::vector<unsigned char>> buffers(batch_size);
+  std::vector<bm::bvector<>> chunks(batch_size, bm::bvector<>(bm::BM_GAP));
+
+  std::string line;
+  size_t n_bytes = 0;
+  size_t n_chunks = batch_size;
+  while (n_chunks == batch_size) {
+    n_chunks = 0;
+    while (n_chunks < batch_size && std::getline(*stream, line)) {
+      size_t next_buffer_size = std::stoul(line);
+      buffers[n_chunks].resize(next_buffer_size);
+      stream->read(reinterpret_cast<char*>(buffers[n_chunks].data()), next_buffer_size);
+      n_bytes += line.size() + 1 + next_buffer_size;
+      ++n_chunks;
+    }
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(n_threads)
+    for (size_t i = 0; i < n_chunks; ++i) {
+      DeserializeChunk(buffers[i].data(), subset, &chunks[i]);
+    }
+
+    // The chunks typically cover disjoint ranges of reads so merge()
+    // can move their blocks into `ec_configs` instead of ORing them.
+    for (size_t i = 0; i < n_chunks; ++i) {
+      ec_configs->merge(chunks[i]);
+      chunks[i].clear(true);
+    }
+  }
+  ec_configs->resize(n_bits);
+  Metrics::global().add(counter_bytes_read, n_bytes);
+}
+
+class BlockReader {
+  // telescope::BlockReader
+  //
+  // Reads an istream into a ring of `n_blocks` large blocks on a
+  // background thread, so that reading (and decompressing) the input
+  // overlaps with parsing the blocks that have already been read. The
+  // blocks are handed to the consumer without copying and returned to
+  // the ring when the next block is requested.
+  //
+private:
+  std::istream *stream;
+  std::vector<std::vector<char>> blocks;
+
+  std::thread producer;
+  std::mutex mutex;
+  std::condition_variable block_ready;
+  std::condition_variable block_consumed;
+  std::deque<std::pair<size_t, size_t>> filled; // Index and number of bytes of each filled block.
+  std::deque<size_t> free_blocks;
+  bool has_current;
+  size_t current;
+  bool done;
+  bool stop;
+  std::exception_ptr error;
+
+  void produce() {
+    try {
+      while (true) {
+	size_t block;
+	{
+	  std::unique_lock<std::mutex> lock(this->mutex);
+	  this->block_consumed.wait(lock, [this]{ return this->stop || !this->free_blocks.empty(); });
+	  if (this->stop) {
+	    return;
+	  }
+	  block = this->free_blocks.front();
+	  this->free_blocks.pop_front();
+	}
+	this->stream->read(this->blocks[block].data(), this->blocks[block].size());
+	size_t n_bytes = this->stream->gcount();
+	if (n_bytes == 0) {
+	  break;
+	}
+	Metrics::global().add(counter_bytes_read, n_bytes);
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->filled.emplace_back(block, n_bytes);
+	this->block_ready.notify_one();
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->done = true;
+    this->block_ready.notify_one();
+  }
+
+public:
+  BlockReader(std::istream *_stream, const size_t block_size = 4194304, const size_t n_blocks = 4) {
+    this->stream = _stream;
+    this->blocks = std::vector<std::vector<char>>(n_blocks, std::vector<char>(block_size));
+    for (size_t i = 0; i < n_blocks; ++i) {
+      this->free_blocks.emplace_back(i);
+    }
+    this->has_current = false;
+    this->done = false;
+    this->stop = false;
+    this->producer = std::thread(&BlockReader::produce, this);
+  }
+
+  ~BlockReader() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stop = true;
+    }
+    this->block_consumed.notify_one();
+    this->producer.join();
+  }
+
+  // Set `begin` and `end` to the contents of the next block. The
+  // pointers are valid until the next call. Returns false when the
+  // whole stream has been read.
+  bool next(const char **begin, const char **end) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (this->has_current) {
+      this->free_blocks.emplace_back(this->current);
+      this->has_current = false;
+      this->block_consumed.notify_one();
+    }
+    this->block_ready.wait(lock, [this]{ return this->done || !this->filled.empty(); });
+    if (this->filled.empty()) {
+      if (this->error) {
+	std::rethrow_exception(this->error);
+      }
+      return false;
+    }
+    this->current = this->filled.front().first;
+    *begin = this->blocks[this->current].data();
+    *end = *begin + this->filled.front().second;
+    this->filled.pop_front();
+    this->has_current = true;
+    return true;
+  }
+};
+
+class LineReader {
+  // telescope::LineReader
+  //
+  // Returns pointers to the lines in the blocks read by a BlockReader,
+  // so the lines are not copied into a std::string. Only lines that
+  // cross a block boundary are copied.
+  //
+private:
+  BlockReader blocks;
+  const char *block_pos;
+  const char *block_end;
+
+  // Start of a line that continues in the next block.
+  std::vector<char> carry;
+  bool clear_carry;
+
+public:
+  LineReader(std::istream *_stream, const size_t buffer_size = 4194304) : blocks(_stream, buffer_size) {
+    this->block_pos = nullptr;
+    this->block_end = nullptr;
+    this->clear_carry = false;
+  }
+
+  // Set `begin` and `end` to the start and end of the next line
+  // without the line break. The pointers are valid until the next call.
+  // Returns false when there are no more lines.
+  bool next(const char **begin, const char **end) {
+    if (this->clear_carry) {
+      this->carry.clear();
+      this->clear_carry = false;
+    }
+    while (true) {
+      const char *newline = nullptr;
+      if (this->block_pos != this->block_end) {
+	newline = (const char*)std::memchr(this->block_pos, '\n', this->block_end - this->block_pos);
+      }
+      if (newline != nullptr) {
+	if (this->carry.empty()) {
+	  *begin = this->block_pos;
+	  *end = newline;
+	} else {
+	  this->carry.insert(this->carry.end(), this->block_pos, newline);
+	  *begin = this->carry.data();
+	  *end = this->carry.data() + this->carry.size();
+	  this->clear_carry = true;
+	}
+	this->block_pos = newline + 1;
+	return true;
+      }
+      this->carry.insert(this->carry.end(), this->block_pos, this->block_end);
+      if (!this->blocks.next(&this->block_pos, &this->block_end)) {
+	// Last line may not end with a line break.
+	this->block_pos = this->block_end;
+	if (this->carry.empty()) {
+	  return false;
+	}
+	*begin = this->carry.data();
+	*end = this->carry.data() + this->carry.size();
+	this->clear_carry = true;
+	return true;
+      }
+    }
+  }
+};
+
+size_t ReadPlaintextLine(const size_t n_targets, const char *begin, const char *end, const size_t line_nr, bm::bvector<>::bulk_insert_iterator &it, const TargetSubset *subset) {
   // telescope::ReadPlaintextLine
   //
   // Reads a line in a plaintext alignment file from Themisto
@@ -60,23 +333,42 @@ void ReadPlaintextLine(const size_t n_targets, std::string &line, bm::bvector<>:
   //   `n_targets`: number of pseudoalignment targets (reference
   //                sequences). It's not possible to infer this from the Themisto
   //                file format so has to be provided separately.
-  //   `line`: the line from the alignment file to read in.
+  //   `begin`, `end`: start and end of the line from the alignment file to read in.
+  //   `line_nr`: number of the line in the file (used in error messages).
   //   `it`: insert iterator to the bm::bvector<> variable for storing the alignment.
+  //   `subset`: targets to keep (or nullptr to keep all). The kept
+  //             targets are stored with their ids in the subset.
+  // Output:
+  //   `read_id`: id of the read on the line.
   //
-  std::string part;
-  std::stringstream partition(line);
-
-  // First column is read id (0-based indexing).
-  std::getline(partition, part, ' ');
-  size_t read_id = std::stoul(part);
-
-  // Next columns contain the target sequence id (0-based indexing).
-  while (std::getline(partition, part, ' ')) {
-    *it = read_id*n_targets + std::stoul(part); // set bit `n_reads*n_refs + std::stoul(part)` as true
+  size_t read_id;
+  bool success;
+  if (subset == nullptr) {
+    success = ParsePlaintextLine(begin, end, &read_id, [&](const size_t target) {
+      if (target >= n_targets) {
+	throw std::runtime_error("Pseudoalignment file has more target sequences than expected on line " + std::to_string(line_nr) + ".");
+      }
+      *it = read_id*n_targets + target; // set bit `n_reads*n_refs + target` as true
+    });
+  } else {
+    size_t n_kept = subset->n_kept();
+    success = ParsePlaintextLine(begin, end, &read_id, [&](const size_t target) {
+      if (target >= n_targets) {
+	throw std::runtime_error("Pseudoalignment file has more target sequences than expected on line " + std::to_string(line_nr) + ".");
+      }
+      uint32_t kept_target = subset->new_id(target);
+      if (kept_target != TargetSubset::dropped) {
+	*it = read_id*n_kept + kept_target;
+      }
+    });
+  }
+  if (!success) {
+    throw std::runtime_error("File format not supported on line " + std::to_string(line_nr) + " with content: " + std::string(begin, end));
   }
+  return read_id;
 }
 
-size_t ReadPlaintextAlignment(const size_t n_targets, std::string &line, std::istream *stream, bm::bvector<> *ec_configs) {
+size_t ReadPlaintextAlignment(const size_t n_targets, std::string &line, std::istream *stream, bm::bvector<> *ec_configs, const TargetSubset *subset) {
   // telescope::ReadPlaintextAlignment
   //
   // Reads a plaintext alignment file from Themisto
@@ -88,41 +380,36 @@ size_t ReadPlaintextAlignment(const size_t n_targets, std::string &line, std::is
   //   `n_targets`: number of pseudoalignment targets (reference
   //                sequences). It's not possible to infer this from the Themisto
   //                file format so has to be provided separately.
-  //   `line`: read each line into this variable.
-  //     NOTE: the contents of the *first* line should already be stored in this variable.
+  //   `line`: contents of the *first* line in the file.
   //   `stream`: pointer to an istream opened on the pseudoalignment file.
   //   `ec_configs`: pointer to the output variable that will contain the alignment.
+  //   `subset`: targets to keep (or nullptr to keep all).
   // Output:
   //   `n_reads`: total number of reads in the pseudoalignment (unaligned + aligned).
   //
   bm::bvector<>::bulk_insert_iterator it(*ec_configs); // Bulk insert iterator buffers the insertions
 
+  // Contents of the first line is already stored in `line`
   size_t n_reads = 1;
-  try {
-    // Contents of the first line is already stored in `line`
-    ReadPlaintextLine(n_targets, line, it);
-
-    size_t compress_interval = 1000000;
-    while (std::getline(*stream, line)) {
-      // Insert each line into the alignment
-      ReadPlaintextLine(n_targets, line, it);
-      ++n_reads;
-      if (n_reads % compress_interval == 0) {
-	  ec_configs->optimize();
-      }
-    }
-  } catch (const std::exception &e) {
-    std::string msg(e.what());
-    if (msg.find("stoul") != std::string::npos) {
-      throw std::runtime_error("File format not supported on line " + std::to_string(n_reads) + " with content: " + line);
-    } else {
-      throw std::runtime_error("Could not parse line " + std::to_string(n_reads) + " with content: " + line);
+  ReadPlaintextLine(n_targets, line.data(), line.data() + line.size(), n_reads, it, subset);
+
+  LineReader lines(stream);
+  const char *begin;
+  const char *end;
+  size_t compress_interval = 1000000;
+  while (lines.next(&begin, &end)) {
+    // Insert each line into the alignment
+    ++n_reads;
+    ReadPlaintextLine(n_targets, begin, end, n_reads, it, subset);
+    if (n_reads % compress_interval == 0) {
+      ec_configs->optimize();
+      Metrics::global().add(counter_bvector_optimize, 1);
     }
   }
   return n_reads;
 }
 
-size_t ReadAlignmentFile(const size_t n_targets, std::istream *stream, bm::bvector<> *ec_configs) {
+size_t ReadAlignmentFile(const size_t n_targets, const size_t n_threads, std::istream *stream, bm::bvector<> *ec_configs, const TargetSubset *subset) {
   // telescope::ReadAlignmentFile
   //
   // Wrapper for determining which file format (alignment-writer or
@@ -134,13 +421,17 @@ size_t ReadAlignmentFile(const size_t n_targets, std::istream *stream, bm::bvect
   //                sequences). It's not possible to infer this from the plaintext Themisto
   //                file format so has to be provided separately. If the file is in the
   //                compact format will check that the numbers match.
+  //   `n_threads`: number of threads to use in reading alignment-writer files.
   //   `stream`: pointer to an istream opened on the pseudoalignment file.
   //   `ec_configs`: pointer to the output variable that will contain the alignment.
+  //   `subset`: targets to keep (or nullptr to keep all).
   // Output:
   //   `n_reads`: total number of reads in the pseudoalignment (unaligned + aligned).
   //
+  ScopedPhase phase("read_alignment_file");
   std::string line;
   std::getline(*stream, line); // Read the first line to check the format
+  Metrics::global().add(counter_bytes_read, line.size() + 1);
   size_t n_reads;
   if (line.find(',') != std::string::npos) {
     // First line contains a ','; stream could be in the compact format.
@@ -148,22 +439,361 @@ size_t ReadAlignmentFile(const size_t n_targets, std::istream *stream, bm::bvect
     alignment_writer::ReadHeader(line, &n_reads, &n_refs);
     if (n_refs > n_targets) {
       throw std::runtime_error("Pseudoalignment file has more target sequences than expected.");
-    } else if (n_targets < n_refs) {
+    } else if (n_refs < n_targets) {
       throw std::runtime_error("Pseudoalignment file has less target sequences than expected.");
     }
     // Size is given on the header line.
-    ec_configs->resize(n_reads*n_refs);
-    alignment_writer::UnpackData(stream, *ec_configs);
+    ec_configs->resize(n_reads*(subset == nullptr ? n_refs : subset->n_kept()));
+    if (n_threads > 1) {
+      ReadCompactAlignment(stream, n_threads, ec_configs, subset);
+    } else {
+      ReadCompactAlignment(stream, ec_configs, subset);
+    }
   } else {
     // Stream could be in the plaintext format.
     // Size is unknown.
     ec_configs->set_new_blocks_strat(bm::BM_GAP);
-    n_reads = ReadPlaintextAlignment(n_targets, line, stream, ec_configs);
+    n_reads = ReadPlaintextAlignment(n_targets, line, stream, ec_configs, subset);
+  }
+  Metrics::global().add(counter_reads_parsed, n_reads);
+  return n_reads;
+}
+
+void MergeCompactAlignment(const bm::set_operation &merge_op, std::istream *stream, bm::bvector<> *ec_configs, const TargetSubset *subset, std::mutex *lock) {
+  // telescope::MergeCompactAlignment
+  //
+  // Merges an alignment file that has been compacted with
+  // alignment-writer into `ec_configs` one serialized chunk at a time,
+  // without deserializing the whole file into a temporary bvector.
+  //
+  // Input:
+  //   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of the alignments.
+  //   `stream`: pointer to an istream opened on the pseudoalignment file.
+  //     NOTE:   Use alignment_writer::ReadHeader before calling this function!
+  //   `ec_configs`: pointer to the alignment to merge into.
+  //   `subset`: targets to keep (or nullptr to keep all).
+  //   `lock`: held while modifying `ec_configs` (or nullptr if no other thread modifies it).
+  //
+  if (merge_op != bm::set_AND && merge_op != bm::set_OR) {
+    throw std::runtime_error("Unknown paired alignment merge mode.");
+  }
+  size_t n_bits;
+  {
+    std::unique_lock<std::mutex> guard = LockIf(lock);
+    n_bits = ec_configs->size();
+  }
+
+  // The chunks cover consecutive ranges of the alignment, so an AND
+  // with a chunk is restricted to the bits from the end of the
+  // previous chunk to the last bit in the chunk. Bits before
+  // `first_unmerged` have already been intersected with the file.
+  size_t first_unmerged = 0;
+  bm::bvector<> chunk(bm::BM_GAP);
+  bm::bvector<> window(bm::BM_GAP);
+  bm::operation_deserializer<bm::bvector<>> deserializer;
+
+  std::vector<unsigned char> buffer;
+  std::string line;
+  size_t n_bytes = 0;
+  while (std::getline(*stream, line)) {
+    size_t next_buffer_size = std::stoul(line);
+    buffer.resize(next_buffer_size);
+    stream->read(reinterpret_cast<char*>(buffer.data()), next_buffer_size);
+    n_bytes += line.size() + 1 + next_buffer_size;
+    if (merge_op == bm::set_OR && subset == nullptr) {
+      // OR the chunk directly into `ec_configs`.
+      std::unique_lock<std::mutex> guard = LockIf(lock);
+      deserializer.deserialize(*ec_configs, buffer.data(), bm::set_OR);
+      continue;
+    }
+    DeserializeChunk(buffer.data(), subset, &chunk);
+    std::unique_lock<std::mutex> guard = LockIf(lock);
+    bm::bvector<>::size_type last;
+    if (merge_op == bm::set_OR) {
+      (*ec_configs) |= chunk;
+    } else if (chunk.find_reverse(last)) {
+      window.copy_range(*ec_configs, first_unmerged, last);
+      window &= chunk;
+      ec_configs->set_range(first_unmerged, last, false);
+      ec_configs->merge(window);
+      first_unmerged = last + 1;
+    }
+    chunk.clear(true);
+  }
+
+  std::unique_lock<std::mutex> guard = LockIf(lock);
+  if (merge_op == bm::set_AND && first_unmerged < n_bits) {
+    // Reads after the last bit in the file did not align.
+    ec_configs->set_range(first_unmerged, n_bits - 1, false);
+  }
+  ec_configs->resize(n_bits);
+  Metrics::global().add(counter_bytes_read, n_bytes);
+}
+
+size_t MergePlaintextAlignment(const bm::set_operation &merge_op, const size_t n_targets, std::string &line, std::istream *stream, bm::bvector<> *ec_configs, const TargetSubset *subset, std::mutex *lock) {
+  // telescope::MergePlaintextAlignment
+  //
+  // Merges a plaintext alignment file from Themisto into `ec_configs`
+  // one window of `window_size` lines at a time, so only the reads in
+  // the current window are stored besides `ec_configs`. The reads do
+  // not have to be sorted by read id. Returns the number of reads in
+  // the file (both unaligned and aligned).
+  //
+  // Input:
+  //   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of the alignments.
+  //   `n_targets`: number of pseudoalignment targets (reference sequences).
+  //   `line`: contents of the *first* line in the file.
+  //   `stream`: pointer to an istream opened on the pseudoalignment file.
+  //   `ec_configs`: pointer to the alignment to merge into.
+  //   `subset`: targets to keep (or nullptr to keep all).
+  //   `lock`: held while modifying `ec_configs` (or nullptr if no other thread modifies it).
+  // Output:
+  //   `n_reads`: total number of reads in the file (unaligned + aligned).
+  //
+  if (merge_op != bm::set_AND && merge_op != bm::set_OR) {
+    throw std::runtime_error("Unknown paired alignment merge mode.");
+  }
+  size_t n_columns = (subset == nullptr ? n_targets : subset->n_kept());
+  size_t window_size = 1000000;
+
+  // `bits` contains the alignments of the reads in the current window
+  // and `rows` all bits on the rows of those reads.
+  bm::bvector<> bits(bm::BM_GAP);
+  bm::bvector<> rows(bm::BM_GAP);
+
+  LineReader lines(stream);
+  const char *begin = line.data(); // Contents of the first line is already stored in `line`
+  const char *end = line.data() + line.size();
+  size_t n_reads = 0;
+  bool lines_left = true;
+  while (lines_left) {
+    {
+      bm::bvector<>::bulk_insert_iterator it(bits);
+      for (size_t i = 0; i < window_size; ++i) {
+	if (n_reads > 0 && !lines.next(&begin, &end)) {
+	  lines_left = false;
+	  break;
+	}
+	++n_reads;
+	size_t read_id = ReadPlaintextLine(n_targets, begin, end, n_reads, it, subset);
+	if (merge_op == bm::set_AND) {
+	  rows.set_range(read_id*n_columns, (read_id + 1)*n_columns - 1);
+	}
+      }
+    }
+
+    std::unique_lock<std::mutex> guard = LockIf(lock);
+    if (merge_op == bm::set_OR) {
+      ec_configs->merge(bits);
+    } else {
+      // Clear the bits on the rows in the window that are not set in the file.
+      rows -= bits;
+      (*ec_configs) -= rows;
+    }
+    bits.clear(true);
+    rows.clear(true);
+  }
+  return n_reads;
+}
+
+size_t MergeAlignmentFile(const bm::set_operation &merge_op, const size_t n_targets, const size_t n_reads, std::istream *stream, bm::bvector<> *ec_configs, const TargetSubset *subset, std::mutex *lock) {
+  // telescope::MergeAlignmentFile
+  //
+  // Reads a pseudoalignment file in the plaintext or alignment-writer
+  // format and merges it into `ec_configs`. Files in the
+  // alignment-writer format are merged one chunk at a time and
+  // plaintext files one window of reads at a time, so the file is
+  // never stored in full. Returns the number of aligned + unaligned
+  // reads in the file.
+  //
+  // Input:
+  //   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of the alignments.
+  //   `n_targets`: number of pseudoalignment targets (reference sequences).
+  //   `n_reads`: number of reads in `ec_configs`.
+  //   `stream`: pointer to an istream opened on the pseudoalignment file.
+  //   `ec_configs`: pointer to the alignment to merge into.
+  //   `subset`: targets to keep (or nullptr to keep all).
+  //   `lock`: held while modifying `ec_configs` (or nullptr if no other thread modifies it).
+  // Output:
+  //   `n_processed`: total number of reads in the pseudoalignment file (unaligned + aligned).
+  //
+  ScopedPhase phase("merge_alignment_file");
+  std::string line;
+  std::getline(*stream, line); // Read the first line to check the format
+  Metrics::global().add(counter_bytes_read, line.size() + 1);
+  size_t n_processed;
+  if (line.find(',') != std::string::npos) {
+    // First line contains a ','; stream could be in the compact format.
+    size_t n_refs;
+    alignment_writer::ReadHeader(line, &n_processed, &n_refs);
+    if (n_refs > n_targets) {
+      throw std::runtime_error("Pseudoalignment file has more target sequences than expected.");
+    } else if (n_refs < n_targets) {
+      throw std::runtime_error("Pseudoalignment file has less target sequences than expected.");
+    }
+    if (n_processed != n_reads) {
+      throw std::runtime_error("Pseudoalignment files have different numbers of pseudoalignments.");
+    }
+    MergeCompactAlignment(merge_op, stream, ec_configs, subset, lock);
+  } else {
+    // Stream could be in the plaintext format.
+    n_processed = MergePlaintextAlignment(merge_op, n_targets, line, stream, ec_configs, subset, lock);
+    if (n_processed != n_reads) {
+      throw std::runtime_error("Pseudoalignment files have different numbers of pseudoalignments.");
+    }
+  }
+  Metrics::global().add(counter_reads_parsed, n_processed);
+  return n_processed;
+}
+
+size_t ParallelMergeAlignmentFiles(const bm::set_operation &merge_op, const size_t n_targets, std::vector<std::istream*> &streams, bm::bvector<> *ec_configs, const size_t n_threads, std::vector<double> *file_seconds, const TargetSubset *subset) {
+  // telescope::ParallelMergeAlignmentFiles
+  //
+  // Reads the first pseudoalignment file in `streams` into
+  // `ec_configs` and merges the other files into it concurrently, up
+  // to `n_threads` files at a time. Each file is merged one window of
+  // reads or one alignment-writer chunk at a time (see
+  // MergeAlignmentFile), so only `ec_configs` and one window per thread
+  // are stored in memory. The files can be in any mix of the plaintext
+  // and alignment-writer formats. Returns the number of reads
+  // (unaligned + aligned) in the alignment.
+  //
+  // Input:
+  //   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of the alignments.
+  //   `n_targets`: number of pseudoalignment targets (reference sequences).
+  //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+  //   `ec_configs`: pointer to the output variable that will contain the alignment.
+  //   `n_threads`: number of threads to use.
+  //   `file_seconds`: time spent reading each file (or nullptr).
+  //   `subset`: targets to keep (or nullptr to keep all).
+  // Output:
+  //   `n_reads`: total number of reads in the pseudoalignment (unaligned + aligned).
+  //
+  size_t n_streams = streams.size();
+  size_t n_files = std::min(n_threads, n_streams - 1);
+  std::vector<double> seconds(n_streams, 0.0);
+
+  size_t n_reads;
+  {
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    n_reads = ReadAlignmentFile(n_targets, n_threads, streams[0], ec_configs, subset);
+    seconds[0] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  // Plaintext files don't fill the rows after the last aligned read.
+  ec_configs->resize(n_reads*(subset == nullptr ? n_targets : subset->n_kept()));
+
+  // Intersections and unions of the windows can be applied in any
+  // order, so the files only need to take turns modifying `ec_configs`.
+  std::mutex lock;
+  std::vector<std::exception_ptr> errors(n_streams);
+#pragma omp parallel for schedule(dynamic, 1) num_threads(n_files)
+  for (size_t i = 1; i < n_streams; ++i) {
+    try {
+      std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+      MergeAlignmentFile(merge_op, n_targets, n_reads, streams[i], ec_configs, subset, &lock);
+      seconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  }
+  for (size_t i = 1; i < n_streams; ++i) {
+    if (errors[i]) {
+      std::rethrow_exception(errors[i]);
+    }
+  }
+
+  ec_configs->optimize();
+  Metrics::global().add(counter_bvector_optimize, 1);
+  if (file_seconds != nullptr) {
+    *file_seconds = std::move(seconds);
   }
   return n_reads;
 }
 
-size_t ReadPairedAlignments(const bm::set_operation &merge_op, const size_t n_targets, std::vector<std::istream*> &streams, bm::bvector<> *ec_configs) {
+size_t ConcatenateAlignmentFiles(const size_t n_targets, std::vector<std::istream*> &streams, bm::bvector<> *ec_configs, const size_t n_threads, std::vector<size_t> *lane_offsets, std::vector<double> *file_seconds, const TargetSubset *subset) {
+  // telescope::ConcatenateAlignmentFiles
+  //
+  // Reads the pseudoalignment files in `streams` concurrently into
+  // separate alignments and splices them into `ec_configs` so that the
+  // reads of each file follow the reads of the previous file. Returns
+  // the number of reads (unaligned + aligned) in all of the files.
+  //
+  // Input:
+  //   `n_targets`: number of pseudoalignment targets (reference sequences).
+  //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+  //   `ec_configs`: pointer to the output variable that will contain the alignment.
+  //   `n_threads`: number of threads to use.
+  //   `lane_offsets`: first read id of each file and the total number of reads (or nullptr).
+  //   `file_seconds`: time spent reading each file (or nullptr).
+  //   `subset`: targets to keep (or nullptr to keep all).
+  // Output:
+  //   `n_reads`: total number of reads in the pseudoalignment (unaligned + aligned).
+  //
+  ScopedPhase phase("concatenate_alignment_files");
+  size_t n_streams = streams.size();
+  size_t n_files = std::max(std::min(n_threads, n_streams), (size_t)1);
+  size_t threads_per_file = std::max(n_threads/n_files, (size_t)1);
+  size_t n_columns = (subset == nullptr ? n_targets : subset->n_kept());
+
+  std::vector<bm::bvector<>> lanes(n_streams, bm::bvector<>(bm::BM_GAP));
+  std::vector<size_t> n_processed(n_streams, 0);
+  std::vector<double> seconds(n_streams, 0.0);
+  std::vector<std::exception_ptr> errors(n_streams);
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(n_files)
+  for (size_t i = 0; i < n_streams; ++i) {
+    try {
+      std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+      n_processed[i] = ReadAlignmentFile(n_targets, threads_per_file, streams[i], &lanes[i], subset);
+      seconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  }
+  for (size_t i = 0; i < n_streams; ++i) {
+    if (errors[i]) {
+      std::rethrow_exception(errors[i]);
+    }
+  }
+
+  std::vector<size_t> offsets(n_streams + 1, 0);
+  for (size_t i = 0; i < n_streams; ++i) {
+    offsets[i + 1] = offsets[i] + n_processed[i];
+  }
+
+  // Move the reads of each file to its range of read ids. The ranges
+  // are disjoint so merge() can move the blocks into `ec_configs`.
+#pragma omp parallel for schedule(dynamic, 1) num_threads(n_files)
+  for (size_t i = 1; i < n_streams; ++i) {
+    bm::bvector<> shifted(bm::BM_GAP);
+    bm::bvector<>::bulk_insert_iterator it(shifted);
+    size_t shift = offsets[i]*n_columns;
+    for (bm::bvector<>::enumerator en = lanes[i].first(); en.valid(); ++en) {
+      *it = *en + shift;
+    }
+    it.flush();
+    lanes[i].swap(shifted);
+  }
+  ec_configs->clear(true);
+  for (size_t i = 0; i < n_streams; ++i) {
+    ec_configs->merge(lanes[i]);
+    lanes[i].clear(true);
+  }
+  size_t n_reads = offsets.back();
+  ec_configs->resize(n_reads*n_columns);
+  ec_configs->optimize();
+  Metrics::global().add(counter_bvector_optimize, 1);
+
+  if (file_seconds != nullptr) {
+    *file_seconds = std::move(seconds);
+  }
+  if (lane_offsets != nullptr) {
+    *lane_offsets = std::move(offsets);
+  }
+  return n_reads;
+}
+
+size_t ReadPairedAlignments(const bm::set_operation &merge_op, const size_t n_targets, std::vector<std::istream*> &streams, bm::bvector<> *ec_configs, const size_t n_threads, std::vector<double> *file_seconds, const TargetSubset *subset) {
   // telescope::ReadPairedAlignments
   //
   // Reads one or more pseudoalignment files from Themisto for
@@ -179,44 +809,517 @@ size_t ReadPairedAlignments(const bm::set_operation &merge_op, const size_t n_ta
   //                compact format will check that the numbers match.
   //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
   //   `ec_configs`: pointer to the output variable that will contain the alignment.
+  //   `n_threads`: number of threads to use.
+  //   `file_seconds`: time spent reading each file (or nullptr).
+  //   `subset`: targets to keep (or nullptr to keep all).
   // Output:
   //   `n_reads`: total number of reads in the pseudoalignment (unaligned + aligned).
   //
-  uint8_t n_streams = streams.size(); // Typically 1 (unpaired reads) or 2 (paired reads).
-  size_t n_reads;
+  ScopedPhase phase("read_paired_alignments");
+  if (merge_op == set_concatenate) {
+    return ConcatenateAlignmentFiles(n_targets, streams, ec_configs, n_threads, nullptr, file_seconds, subset);
+  }
+  size_t n_streams = streams.size(); // Typically 1 (unpaired reads) or 2 (paired reads).
+  if (n_threads > 1 && n_streams > 2) {
+    return ParallelMergeAlignmentFiles(merge_op, n_targets, streams, ec_configs, n_threads, file_seconds, subset);
+  }
 
-  for (uint8_t i = 0; i < n_streams; ++i) {
+  size_t n_reads = 0;
+  std::vector<double> seconds(n_streams, 0.0);
+  for (size_t i = 0; i < n_streams; ++i) {
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
     if (i == 0) {
       // Read the first alignments in-place to the output variable.
-      n_reads = ReadAlignmentFile(n_targets, streams[i], ec_configs);
+      n_reads = ReadAlignmentFile(n_targets, n_threads, streams[i], ec_configs, subset);
     } else {
-      // Initialize a temporary object for storing the alignments.
-      bm::bvector<> new_configs(n_reads*n_targets, bm::BM_GAP);
-      size_t n_processed;
-      n_processed = ReadAlignmentFile(n_targets, streams[i], &new_configs);
+      // Merge the other files into `ec_configs`. Themisto's output from
+      // paired-end reads should contain the same amount of reads.
+      MergeAlignmentFile(merge_op, n_targets, n_reads, streams[i], ec_configs, subset, nullptr);
+    }
+    seconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  if (file_seconds != nullptr) {
+    *file_seconds = std::move(seconds);
+  }
+  return n_reads;
+}
+
+class PlaintextRowReader : public RowReader {
+  // telescope::PlaintextRowReader
+  //
+  // Reads a plaintext alignment file from Themisto one line at a time.
+  //
+private:
+  size_t n_targets;
+  std::string first_line;
+  bool first_line_pending;
+  LineReader lines;
+  size_t n_lines;
+
+public:
+  // `line` should contain the first line of the file.
+  PlaintextRowReader(const size_t _n_targets, const std::string &_line, std::istream *_stream) : lines(_stream) {
+    this->n_targets = _n_targets;
+    this->first_line = _line;
+    this->first_line_pending = true;
+    this->n_lines = 0;
+  }
+
+  bool next(size_t *read_id, std::vector<uint32_t> *targets) override {
+    const char *begin = this->first_line.data();
+    const char *end = begin + this->first_line.size();
+    while (this->first_line_pending || this->lines.next(&begin, &end)) {
+      this->first_line_pending = false;
+      ++this->n_lines;
+      targets->clear();
+      bool success = ParsePlaintextLine(begin, end, read_id, [targets](const size_t target) {
+	targets->emplace_back(target);
+      });
+      if (!success) {
+	throw std::runtime_error("File format not supported on line " + std::to_string(this->n_lines) + " with content: " + std::string(begin, end));
+      }
+      if (!targets->empty()) {
+	std::sort(targets->begin(), targets->end());
+	targets->erase(std::unique(targets->begin(), targets->end()), targets->end());
+	if (targets->back() >= this->n_targets) {
+	  throw std::runtime_error("Pseudoalignment file has more target sequences than expected on line " + std::to_string(this->n_lines) + ".");
+	}
+	return true;
+      }
+    }
+    return false;
+  }
+
+  size_t n_reads() const override { return this->n_lines; }
+};
+
+class CompactRowReader : public RowReader {
+  // telescope::CompactRowReader
+  //
+  // Reads an alignment file that has been compacted with
+  // alignment-writer (https://github.com/tmaklin/alignment-writer)
+  // one chunk at a time. Only the current chunk is stored in memory.
+  //
+private:
+  size_t n_targets;
+  size_t n_reads_in_header;
+  std::istream *stream;
+  bm::bvector<> chunk;
+  bm::bvector<>::enumerator en;
+
+  bool next_chunk() {
+    std::string line;
+    if (!std::getline(*this->stream, line)) {
+      return false;
+    }
+    size_t next_buffer_size = std::stoul(line);
+    this->chunk.clear(true);
+    alignment_writer::DeserializeBuffer(next_buffer_size, this->stream, &this->chunk);
+    Metrics::global().add(counter_bytes_read, line.size() + 1 + next_buffer_size);
+    // Reposition the enumerator that is bound to `chunk` instead of
+    // assigning a new one over it: the old position refers to blocks
+    // that clear() has already freed.
+    this->en.go_first();
+    return true;
+  }
+
+public:
+  // Use alignment_writer::ReadHeader to get `_n_reads` before calling this.
+  // The enumerator is not valid until the first chunk has been read.
+  CompactRowReader(const size_t _n_targets, const size_t _n_reads, std::istream *_stream) : en(&this->chunk) {
+    this->n_targets = _n_targets;
+    this->n_reads_in_header = _n_reads;
+    this->stream = _stream;
+  }
+
+  bool next(size_t *read_id, std::vector<uint32_t> *targets) override {
+    while (!this->en.valid()) {
+      if (!this->next_chunk()) {
+	return false;
+      }
+    }
+    *read_id = (*this->en)/this->n_targets;
+    size_t row_start = (*read_id)*this->n_targets;
+    size_t row_end = row_start + this->n_targets;
+    targets->clear();
+    while (true) {
+      // A read can be split between two consecutive chunks.
+      for (; this->en.valid() && *this->en < row_end; ++this->en) {
+	targets->emplace_back(*this->en - row_start);
+      }
+      if (this->en.valid() || !this->next_chunk()) {
+	break;
+      }
+    }
+    return true;
+  }
+
+  size_t n_reads() const override { return this->n_reads_in_header; }
+};
+
+class PairedRowReader : public RowReader {
+  // telescope::PairedRowReader
+  //
+  // Merges the reads from several RowReaders record by record with
+  // either bm::set_OR (union) or bm::set_AND (intersection). All
+  // readers must return the reads in increasing order of the read id.
+  //
+private:
+  bm::set_operation merge_op;
+  std::vector<std::unique_ptr<RowReader>> readers;
+
+  // Next read from each reader.
+  std::vector<bool> has_next;
+  std::vector<size_t> next_ids;
+  std::vector<std::vector<uint32_t>> next_targets;
+
+  std::vector<uint32_t> merged;
+
+  void advance(const size_t i) {
+    size_t previous_id = this->next_ids[i];
+    this->has_next[i] = this->readers[i]->next(&this->next_ids[i], &this->next_targets[i]);
+    if (this->has_next[i] && this->next_ids[i] <= previous_id) {
+      throw std::runtime_error("Streaming paired alignments requires the reads to be sorted by read id (run Themisto with --sort-output).");
+    }
+  }
+
+public:
+  PairedRowReader(const bm::set_operation &_merge_op, std::vector<std::unique_ptr<RowReader>> &_readers) {
+    if (_merge_op != bm::set_AND && _merge_op != bm::set_OR) {
+      throw std::runtime_error("Unknown paired alignment merge mode.");
+    }
+    this->merge_op = _merge_op;
+    this->readers = std::move(_readers);
+    size_t n_readers = this->readers.size();
+    this->has_next = std::vector<bool>(n_readers, false);
+    this->next_ids = std::vector<size_t>(n_readers, 0);
+    this->next_targets = std::vector<std::vector<uint32_t>>(n_readers);
+    for (size_t i = 0; i < n_readers; ++i) {
+      this->has_next[i] = this->readers[i]->next(&this->next_ids[i], &this->next_targets[i]);
+    }
+  }
 
-      // Themisto's output from paired-end reads should contain the same amount of reads.
-      if (n_processed != n_reads) {
+  bool next(size_t *read_id, std::vector<uint32_t> *targets) override {
+    size_t n_readers = this->readers.size();
+    while (true) {
+      // Find the smallest read id among the next reads.
+      bool any_next = false;
+      size_t min_id = 0;
+      for (size_t i = 0; i < n_readers; ++i) {
+	if (this->has_next[i] && (!any_next || this->next_ids[i] < min_id)) {
+	  min_id = this->next_ids[i];
+	  any_next = true;
+	}
+      }
+      if (!any_next) {
+	return false;
+      }
+
+      // Merge the readers that contain the read.
+      size_t n_found = 0;
+      targets->clear();
+      for (size_t i = 0; i < n_readers; ++i) {
+	if (this->has_next[i] && this->next_ids[i] == min_id) {
+	  if (n_found == 0) {
+	    targets->swap(this->next_targets[i]);
+	  } else if (this->merge_op == bm::set_AND) {
+	    this->merged.clear();
+	    std::set_intersection(targets->begin(), targets->end(), this->next_targets[i].begin(), this->next_targets[i].end(), std::back_inserter(this->merged));
+	    targets->swap(this->merged);
+	  } else {
+	    this->merged.clear();
+	    std::set_union(targets->begin(), targets->end(), this->next_targets[i].begin(), this->next_targets[i].end(), std::back_inserter(this->merged));
+	    targets->swap(this->merged);
+	  }
+	  ++n_found;
+	  this->advance(i);
+	}
+      }
+
+      // m_intersection: the read must align in every file.
+      if (this->merge_op == bm::set_OR || (n_found == n_readers && !targets->empty())) {
+	*read_id = min_id;
+	return true;
+      }
+    }
+  }
+
+  size_t n_reads() const override {
+    // Themisto's output from paired-end reads should contain the same amount of reads.
+    size_t n_reads = this->readers[0]->n_reads();
+    for (size_t i = 1; i < this->readers.size(); ++i) {
+      if (this->readers[i]->n_reads() != n_reads) {
 	throw std::runtime_error("Pseudoalignment files have different numbers of pseudoalignments.");
       }
+    }
+    return n_reads;
+  }
+};
 
-      // Merge the temporary into the the output `ec_configs`.
-      if (merge_op == bm::set_AND) {
-	// m_intersection: both reads in a pair should align to be considered a match.
-	(*ec_configs) &= new_configs;
-      } else if (merge_op == bm::set_OR){
-	// m_union: count alignments regardless of pair's status.
-	(*ec_configs) |= new_configs;
-      } else {
-	throw std::runtime_error("Unknown paired alignment merge mode.");
+class ConcatRowReader : public RowReader {
+  // telescope::ConcatRowReader
+  //
+  // Reads the rows from several RowReaders one reader after another
+  // and shifts the read ids of each reader to follow the reads of the
+  // previous readers.
+  //
+private:
+  std::vector<std::unique_ptr<RowReader>> readers;
+  size_t current;
+
+  // First read id of each reader that has been started.
+  std::vector<size_t> offsets;
+  std::vector<size_t> *lane_offsets;
+
+public:
+  // `_lane_offsets` is set to the first read id of each reader followed
+  // by the total number of reads once all readers have been exhausted.
+  ConcatRowReader(std::vector<std::unique_ptr<RowReader>> &_readers, std::vector<size_t> *_lane_offsets) {
+    this->readers = std::move(_readers);
+    this->current = 0;
+    this->offsets = std::vector<size_t>(1, 0);
+    this->lane_offsets = _lane_offsets;
+  }
+
+  bool next(size_t *read_id, std::vector<uint32_t> *targets) override {
+    while (this->current < this->readers.size()) {
+      if (this->readers[this->current]->next(read_id, targets)) {
+	*read_id += this->offsets.back();
+	return true;
+      }
+      this->offsets.emplace_back(this->offsets.back() + this->readers[this->current]->n_reads());
+      ++this->current;
+      if (this->current == this->readers.size() && this->lane_offsets != nullptr) {
+	*this->lane_offsets = this->offsets;
       }
     }
+    return false;
   }
-  return n_reads;
+
+  size_t n_reads() const override {
+    size_t n_reads = 0;
+    for (size_t i = 0; i < this->readers.size(); ++i) {
+      n_reads += this->readers[i]->n_reads();
+    }
+    return n_reads;
+  }
+};
+
+class ProjectedRowReader : public RowReader {
+  // telescope::ProjectedRowReader
+  //
+  // Keeps only the targets in a TargetSubset from the rows of another
+  // RowReader and skips the reads that have no kept targets.
+  //
+private:
+  std::unique_ptr<RowReader> reader;
+  const TargetSubset *subset;
+
+public:
+  ProjectedRowReader(std::unique_ptr<RowReader> &_reader, const TargetSubset *_subset) {
+    this->reader = std::move(_reader);
+    this->subset = _subset;
+  }
+
+  bool next(size_t *read_id, std::vector<uint32_t> *targets) override {
+    while (this->reader->next(read_id, targets)) {
+      this->subset->project(targets);
+      if (!targets->empty()) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  size_t n_reads() const override { return this->reader->n_reads(); }
+};
+
+class PrefetchRowReader : public RowReader {
+  // telescope::PrefetchRowReader
+  //
+  // Reads the rows from another RowReader on a background thread in
+  // batches, so that parsing and decompressing the input overlaps with
+  // consuming the rows. At most `max_batches` batches are buffered and
+  // each batch is freed after it has been consumed.
+  //
+private:
+  struct Batch {
+    std::vector<size_t> read_ids;
+    std::vector<size_t> offsets; // Targets of row `i` are in targets[offsets[i]] ... targets[offsets[i + 1] - 1]
+    std::vector<uint32_t> targets;
+  };
+
+  std::unique_ptr<RowReader> reader;
+  size_t batch_size;
+  size_t max_batches;
+
+  std::thread producer;
+  std::mutex mutex;
+  std::condition_variable batch_ready;
+  std::condition_variable batch_consumed;
+  std::deque<Batch> batches;
+  bool done;
+  bool stop;
+  std::exception_ptr error;
+
+  // Batch that is currently being consumed.
+  Batch current;
+  size_t current_row;
+
+  void produce() {
+    try {
+      size_t read_id;
+      std::vector<uint32_t> targets;
+      bool has_next = true;
+      while (has_next) {
+	Batch batch;
+	batch.offsets.emplace_back(0);
+	while (batch.read_ids.size() < this->batch_size && (has_next = this->reader->next(&read_id, &targets))) {
+	  batch.read_ids.emplace_back(read_id);
+	  batch.targets.insert(batch.targets.end(), targets.begin(), targets.end());
+	  batch.offsets.emplace_back(batch.targets.size());
+	}
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->batch_consumed.wait(lock, [this]{ return this->stop || this->batches.size() < this->max_batches; });
+	if (this->stop) {
+	  return;
+	}
+	this->batches.emplace_back(std::move(batch));
+	this->batch_ready.notify_one();
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->done = true;
+    this->batch_ready.notify_one();
+  }
+
+public:
+  PrefetchRowReader(std::unique_ptr<RowReader> &_reader, const size_t _batch_size = 65536, const size_t _max_batches = 4) {
+    this->reader = std::move(_reader);
+    this->batch_size = _batch_size;
+    this->max_batches = _max_batches;
+    this->done = false;
+    this->stop = false;
+    this->current_row = 0;
+    this->producer = std::thread(&PrefetchRowReader::produce, this);
+  }
+
+  ~PrefetchRowReader() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stop = true;
+    }
+    this->batch_consumed.notify_one();
+    this->producer.join();
+  }
+
+  bool next(size_t *read_id, std::vector<uint32_t> *targets) override {
+    while (this->current_row >= this->current.read_ids.size()) {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->batch_ready.wait(lock, [this]{ return this->done || !this->batches.empty(); });
+      if (this->batches.empty()) {
+	if (this->error) {
+	  std::rethrow_exception(this->error);
+	}
+	return false;
+      }
+      this->current = std::move(this->batches.front());
+      this->batches.pop_front();
+      this->current_row = 0;
+      this->batch_consumed.notify_one();
+    }
+    *read_id = this->current.read_ids[this->current_row];
+    targets->assign(this->current.targets.begin() + this->current.offsets[this->current_row], this->current.targets.begin() + this->current.offsets[this->current_row + 1]);
+    ++this->current_row;
+    return true;
+  }
+
+  size_t n_reads() const override { return this->reader->n_reads(); }
+};
+
+std::unique_ptr<RowReader> OpenRowReader(const size_t n_targets, std::istream *stream) {
+  // telescope::OpenRowReader
+  //
+  // Wrapper for determining which file format (alignment-writer or
+  // plaintext) is used and returning a RowReader for the format.
+  //
+  // Input:
+  //   `n_targets`: number of pseudoalignment targets (reference
+  //                sequences). It's not possible to infer this from the plaintext Themisto
+  //                file format so has to be provided separately. If the file is in the
+  //                compact format will check that the numbers match.
+  //   `stream`: pointer to an istream opened on the pseudoalignment file.
+  // Output:
+  //   `reader`: RowReader reading the pseudoalignment from `stream`.
+  //
+  std::string line;
+  std::getline(*stream, line); // Read the first line to check the format
+  Metrics::global().add(counter_bytes_read, line.size() + 1);
+  std::unique_ptr<RowReader> reader;
+  if (line.find(',') != std::string::npos) {
+    // First line contains a ','; stream could be in the compact format.
+    size_t n_reads;
+    size_t n_refs;
+    alignment_writer::ReadHeader(line, &n_reads, &n_refs);
+    if (n_refs > n_targets) {
+      throw std::runtime_error("Pseudoalignment file has more target sequences than expected.");
+    } else if (n_refs < n_targets) {
+      throw std::runtime_error("Pseudoalignment file has less target sequences than expected.");
+    }
+    reader.reset(new CompactRowReader(n_targets, n_reads, stream));
+  } else {
+    // Stream could be in the plaintext format.
+    reader.reset(new PlaintextRowReader(n_targets, line, stream));
+  }
+  return reader;
+}
+
+std::unique_ptr<RowReader> StreamPairedAlignments(const bm::set_operation &merge_op, const size_t n_targets, std::vector<std::istream*> &streams, const size_t n_threads, const TargetSubset *subset, std::vector<size_t> *lane_offsets) {
+  // telescope::StreamPairedAlignments
+  //
+  // Opens one or more pseudoalignment files from Themisto for paired
+  // reads for reading one read at a time. Can be in plaintext or
+  // alignment-writer format.
+  //
+  // Input:
+  //   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of multiple alignmnet files
+  //   `n_targets`: number of pseudoalignment targets (reference
+  //                sequences). It's not possible to infer this from the plaintext Themisto
+  //                file format so has to be provided separately. If the file is in the
+  //                compact format will check that the numbers match.
+  //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+  //   `n_threads`: read each file on a separate thread if > 1.
+  //   `subset`: targets to keep (or nullptr to keep all).
+  //   `lane_offsets`: first read id of each concatenated file and the total number of reads (or nullptr).
+  // Output:
+  //   `reader`: RowReader returning the merged reads.
+  //
+  std::vector<std::unique_ptr<RowReader>> readers;
+  for (size_t i = 0; i < streams.size(); ++i) {
+    std::unique_ptr<RowReader> reader = OpenRowReader(n_targets, streams[i]);
+    if (subset != nullptr) {
+      // Project before prefetching so the projection runs on the background thread.
+      reader.reset(new ProjectedRowReader(reader, subset));
+    }
+    if (n_threads > 1 && streams.size() > 1) {
+      reader.reset(new PrefetchRowReader(reader));
+    }
+    readers.emplace_back(std::move(reader));
+  }
+  if (merge_op == set_concatenate) {
+    return std::unique_ptr<RowReader>(new ConcatRowReader(readers, lane_offsets));
+  }
+  if (readers.size() == 1) {
+    return std::move(readers[0]);
+  }
+  return std::unique_ptr<RowReader>(new PairedRowReader(merge_op, readers));
 }
 
 namespace read {
-ThemistoAlignment Themisto(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams) {
+ThemistoAlignment Themisto(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams, const collapse_engine engine, const size_t n_threads, const bool store_read_ids, const TargetSubset *subset) {
   // telescope::read::Themisto
   //
   // Read in a Themisto pseudoalignment and collapse it into
@@ -224,23 +1327,91 @@ ThemistoAlignment Themisto(const bm::set_operation &merge_op, const size_t n_ref
   // sequences are assigned to the same equivalence class.
   //
   // Input:
-  //   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of multiple alignmnet files
+  //   `merge_op`: bm::set_OR for union, bm::set_AND for intersection, or set_concatenate for concatenation of multiple alignmnet files
   //   `n_refs`: number of pseudoalignment targets (reference
   //                sequences). It's not possible to infer this from the plaintext Themisto
   //                file format so has to be provided separately. If the file is in the
   //                compact format will check that the numbers match.
   //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+  //   `engine`: algorithm used to collapse the alignment.
+  //   `n_threads`: number of threads to use in reading and collapsing the alignment.
+  //   `store_read_ids`: store the IDs of the reads assigned to each equivalence class.
+  //   `subset`: targets to keep (or nullptr to keep all).
   // Output:
   //   `aln`: The pseudoalignment as a telescope::ThemistoAlignment object.
   //
   bm::bvector<> ec_configs(bm::BM_GAP);
-  size_t n_reads = ReadPairedAlignments(merge_op, n_refs, streams, &ec_configs);
-  ThemistoAlignment aln(n_refs, n_reads, ec_configs);
-  aln.collapse();
+  size_t n_kept = (subset == nullptr ? n_refs : subset->n_kept());
+  std::vector<size_t> lane_offsets;
+  if (engine == collapse_stream) {
+    std::unique_ptr<RowReader> reader = StreamPairedAlignments(merge_op, n_refs, streams, n_threads, subset, &lane_offsets);
+    ThemistoAlignment aln(n_kept, ec_configs);
+    aln.set_store_read_ids(store_read_ids);
+    aln.collapse(*reader);
+    aln.set_lane_offsets(std::move(lane_offsets));
+    return aln;
+  }
+  size_t n_reads;
+  if (merge_op == set_concatenate) {
+    n_reads = ConcatenateAlignmentFiles(n_refs, streams, &ec_configs, n_threads, &lane_offsets, nullptr, subset);
+  } else {
+    n_reads = ReadPairedAlignments(merge_op, n_refs, streams, &ec_configs, n_threads, nullptr, subset);
+  }
+  ThemistoAlignment aln(n_kept, n_reads, ec_configs);
+  aln.set_store_read_ids(store_read_ids);
+  aln.collapse(engine, n_threads);
+  aln.set_lane_offsets(std::move(lane_offsets));
+  return aln;
+}
+
+ThemistoAlignment ThemistoToConsumer(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams, ECConsumer *consumer, const collapse_engine engine, const size_t n_threads, const TargetSubset *subset) {
+  // telescope::read::ThemistoToConsumer
+  //
+  // Read in a Themisto pseudoalignment and pass each equivalence class
+  // and read assignment to `consumer` as they are created.
+  //
+  // Input:
+  //   `merge_op`: bm::set_OR for union, bm::set_AND for intersection, or set_concatenate for concatenation of multiple alignmnet files
+  //   `n_refs`: number of pseudoalignment targets (reference
+  //                sequences). It's not possible to infer this from the plaintext Themisto
+  //                file format so has to be provided separately. If the file is in the
+  //                compact format will check that the numbers match.
+  //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+  //   `consumer`: receives the equivalence classes and read assignments.
+  //   `engine`: algorithm used to collapse the alignment.
+  //   `n_threads`: number of threads to use in reading and collapsing the alignment.
+  //   `subset`: targets to keep (or nullptr to keep all).
+  // Output:
+  //   `aln`: The equivalence classes and their counts as a telescope::ThemistoAlignment object.
+  //
+  bm::bvector<> ec_configs(bm::BM_GAP);
+  size_t n_kept = (subset == nullptr ? n_refs : subset->n_kept());
+  std::vector<size_t> lane_offsets;
+  ThemistoAlignment aln;
+  if (engine == collapse_stream) {
+    std::unique_ptr<RowReader> reader = StreamPairedAlignments(merge_op, n_refs, streams, n_threads, subset, &lane_offsets);
+    aln = ThemistoAlignment(n_kept, ec_configs);
+    aln.set_store_read_ids(false);
+    aln.set_consumer(consumer);
+    aln.collapse(*reader);
+  } else {
+    size_t n_reads;
+    if (merge_op == set_concatenate) {
+      n_reads = ConcatenateAlignmentFiles(n_refs, streams, &ec_configs, n_threads, &lane_offsets, nullptr, subset);
+    } else {
+      n_reads = ReadPairedAlignments(merge_op, n_refs, streams, &ec_configs, n_threads, nullptr, subset);
+    }
+    aln = ThemistoAlignment(n_kept, n_reads, ec_configs);
+    aln.set_store_read_ids(false);
+    aln.set_consumer(consumer);
+    aln.collapse(engine, n_threads);
+  }
+  aln.set_consumer(nullptr);
+  aln.set_lane_offsets(std::move(lane_offsets));
   return aln;
 }
 
-ThemistoAlignment ThemistoPlain(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams) {
+ThemistoAlignment ThemistoPlain(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams, const size_t n_threads, std::vector<double> *file_seconds, const TargetSubset *subset) {
   // telescope::read::ThemistoPlain
   //
   // Read in a Themisto pseudoalignment in the plain format
@@ -253,34 +1424,58 @@ ThemistoAlignment ThemistoPlain(const bm::set_operation &merge_op, const size_t
   //                file format so has to be provided separately. If the file is in the
   //                compact format will check that the numbers match.
   //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+  //   `n_threads`: number of threads to use in reading the alignment.
+  //   `file_seconds`: if not nullptr, set to the time spent reading each file.
+  //   `subset`: targets to keep (or nullptr to keep all).
   // Output:
   //   `aln`: The pseudoalignment as a telescope::ThemistoAlignment object.
   //
   bm::bvector<> ec_configs(bm::BM_GAP);
-  size_t n_reads = ReadPairedAlignments(merge_op, n_refs, streams, &ec_configs);
-  ThemistoAlignment aln(n_refs, n_reads, ec_configs);
+  size_t n_reads = ReadPairedAlignments(merge_op, n_refs, streams, &ec_configs, n_threads, file_seconds, subset);
+  ThemistoAlignment aln((subset == nullptr ? n_refs : subset->n_kept()), n_reads, ec_configs);
   return aln;
 }
 
-KallistoAlignment ThemistoToKallisto(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams) {
+KallistoAlignment ThemistoToKallisto(const bm::set_operation &merge_op, const size_t n_refs, std::vector<std::istream*> &streams, const collapse_engine engine, const size_t n_threads, const bool store_read_ids, const TargetSubset *subset) {
   // telescope::read::ThemistoToKallisto
   //
   // Read in a Themisto pseudoalignment and convert it into a Kallisto pseudoalignment.
   //
   // Input:
-  //   `merge_op`: bm::set_OR for union or bm::set_AND for intersection of multiple alignmnet files
+  //   `merge_op`: bm::set_OR for union, bm::set_AND for intersection, or set_concatenate for concatenation of multiple alignmnet files
   //   `n_refs`: number of pseudoalignment targets (reference
   //                sequences). It's not possible to infer this from the plaintext Themisto
   //                file format so has to be provided separately. If the file is in the
   //                compact format will check that the numbers match.
   //   `streams`: vector of pointers to the istreams opened on the pseudoalignment files.
+  //   `engine`: algorithm used to collapse the alignment.
+  //   `n_threads`: number of threads to use in reading and collapsing the alignment.
+  //   `store_read_ids`: store the IDs of the reads assigned to each equivalence class.
+  //   `subset`: targets to keep (or nullptr to keep all).
   // Output:
   //   `aln`: The pseudoalignment as a telescope::KallistoAlignment object.
   //
   bm::bvector<> ec_configs(bm::BM_GAP);
-  size_t n_reads = ReadPairedAlignments(merge_op, n_refs, streams, &ec_configs);
-  KallistoAlignment aln(n_refs, n_reads, ec_configs);
-  aln.collapse();
+  size_t n_kept = (subset == nullptr ? n_refs : subset->n_kept());
+  std::vector<size_t> lane_offsets;
+  KallistoAlignment aln;
+  if (engine == collapse_stream) {
+    std::unique_ptr<RowReader> reader = StreamPairedAlignments(merge_op, n_refs, streams, n_threads, subset, &lane_offsets);
+    aln = KallistoAlignment(n_kept, ec_configs);
+    aln.set_store_read_ids(store_read_ids);
+    aln.collapse(*reader);
+  } else {
+    size_t n_reads;
+    if (merge_op == set_concatenate) {
+      n_reads = ConcatenateAlignmentFiles(n_refs, streams, &ec_configs, n_threads, &lane_offsets, nullptr, subset);
+    } else {
+      n_reads = ReadPairedAlignments(merge_op, n_refs, streams, &ec_configs, n_threads, nullptr, subset);
+    }
+    aln = KallistoAlignment(n_kept, n_reads, ec_configs);
+    aln.set_store_read_ids(store_read_ids);
+    aln.collapse(engine, n_threads);
+  }
+  aln.set_lane_offsets(std::move(lane_offsets));
 
   aln.ec_ids = std::vector<uint32_t>(aln.n_ecs(), 0);
   for (uint32_t i = 0; i < aln.n_ecs(); ++i) {
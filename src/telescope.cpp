@@ -24,10 +24,13 @@
 #include <exception>
 #include <cstddef>
 #include <chrono>
+#include <memory>
+#include <sstream>
 
 #include "cxxargs.hpp"
 #include "cxxio.hpp"
 #include "pack.hpp"
+#include "bxzstr.hpp"
 #include "bmconst.h"
 
 #include "telescope_version.h"
@@ -43,8 +46,19 @@ void parse_args(int argc, char* argv[], cxxargs::Arguments &args, cxxio::Out &lo
   args.add_short_argument<std::string>('o', "Output file directory.");
   args.add_long_argument<uint32_t>("n-refs", "Number of reference sequences in the pseudoalignment.");
   args.add_long_argument<bool>("merge", "Merge the themisto alignments rather than converting to kallisto format (default: false).", false);
-  args.add_long_argument<bm::set_operation>("mode", "How to merge paired-end alignments (one of union, intersection; default: intersection)", bm::set_AND);
+  args.add_long_argument<bm::set_operation>("mode", "How to merge paired-end alignments, or concatenate to combine the alignments from several sequencing lanes (one of union, intersection, concatenate; default: intersection)", bm::set_AND);
+  args.add_long_argument<telescope::collapse_engine>("collapse", "Algorithm for collapsing the alignment into equivalence classes (one of hash, sort, legacy, stream; default: hash)", telescope::collapse_hash);
+  args.add_long_argument<size_t>("threads", "Number of threads to use (default: 1).", 1);
+  args.add_long_argument<bool>("read-to-ref", "Write the assignments of reads to equivalence classes in read-to-ref.txt (default: true).", true);
+  args.add_long_argument<bool>("write-index", "Write the equivalence classes and read assignments in the binary pseudoalignments.idx file (default: false).", false);
   args.add_long_argument<bool>("write-compact", "Write themisto format alignments in alignment-writer compressed format (default: true).", true);
+  args.add_long_argument<std::string>("compress-output", "Compress plaintext themisto format alignments written with --write-compact false (one of none, gz, xz; default: none).", "none");
+  args.add_long_argument<std::string>("targets", "Only keep the target sequences whose ids (0-based) are listed in this file, one per line (default: keep all).", "");
+  args.add_long_argument<std::string>("groups", "File with the group of the n:th target sequence on the n:th line; used with --keep-groups (default: none).", "");
+  args.add_long_argument<std::string>("keep-groups", "Only keep the target sequences in these comma-separated groups from --groups (default: keep all).", "");
+  args.add_long_argument<std::string>("cache-dir", "Store the collapsed alignments in this directory and reuse them when converting the same input files again (default: none).", "");
+  args.add_long_argument<size_t>("cache-size", "Maximum size of the cache directory in megabytes (default: 10000).", 10000);
+  args.add_long_argument<std::string>("metrics-json", "Write the time, peak memory use, and counters of each phase in json format to this file (default: none).", "");
   args.add_long_argument<bool>("cin", "Read the last alignment file from cin (default: false).", false);
   args.add_long_argument<bool>("silent", "Suppress status messages (default: false)", false);
   args.add_long_argument<bool>("help", "Print the help message.", false);
@@ -53,6 +67,13 @@ void parse_args(int argc, char* argv[], cxxargs::Arguments &args, cxxio::Out &lo
     log.flush();
   }
   args.parse(argc, argv);
+  if (args.value<size_t>("threads") < 1) {
+    throw std::runtime_error("--threads must be at least 1.");
+  }
+  const std::string &compression = args.value<std::string>("compress-output");
+  if (compression != "none" && compression != "gz" && compression != "xz") {
+    throw std::runtime_error("--compress-output must be one of none, gz, xz.");
+  }
 }
 }
 
@@ -60,12 +81,38 @@ int main(int argc, char* argv[]) {
   telescope::Log log(std::cerr, !telescope::CmdOptionPresent(argv, argv+argc, "--silent"));
   cxxargs::Arguments args("telescope-" + std::string(TELESCOPE_BUILD_VERSION), "Usage: telescope -r <strand_1>,<strand_2> -o <output prefix> --n-refs <number of pseudoalignment targets>");
   log << args.get_program_name() + '\n';
+  uint32_t n_refs;
+  // Targets that are not in the subset are dropped while reading.
+  std::unique_ptr<telescope::TargetSubset> subset;
   try {
     log << "Parsing arguments\n";
     parse_args(argc, argv, args, log);
 
     // Check that the input directories  exist and are accessible
     cxxio::directory_exists(args.value<std::string>('o'));
+
+    if (!args.value<std::string>("targets").empty() && !args.value<std::string>("keep-groups").empty()) {
+      throw std::runtime_error("Use either --targets or --groups and --keep-groups.");
+    } else if (!args.value<std::string>("keep-groups").empty() && args.value<std::string>("groups").empty()) {
+      throw std::runtime_error("--keep-groups requires --groups.");
+    } else if (!args.value<std::string>("groups").empty() && args.value<std::string>("keep-groups").empty()) {
+      throw std::runtime_error("--groups requires --keep-groups.");
+    }
+
+    n_refs = args.value<uint32_t>("n-refs");
+    if (!args.value<std::string>("targets").empty()) {
+      cxxio::In targets_file(args.value<std::string>("targets"));
+      subset.reset(new telescope::TargetSubset(telescope::read::TargetList(n_refs, &targets_file.stream())));
+    } else if (!args.value<std::string>("keep-groups").empty()) {
+      std::vector<std::string> groups;
+      std::stringstream keep_groups(args.value<std::string>("keep-groups"));
+      std::string group;
+      while (std::getline(keep_groups, group, ',')) {
+	groups.emplace_back(group);
+      }
+      cxxio::In groups_file(args.value<std::string>("groups"));
+      subset.reset(new telescope::TargetSubset(telescope::read::TargetGroups(n_refs, &groups_file.stream(), groups)));
+    }
   } catch (std::exception &e) {
     log.verbose = true;
     log << "Parsing arguments failed:\n"
@@ -75,6 +122,10 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  if (!args.value<std::string>("metrics-json").empty()) {
+    telescope::Metrics::global().enable();
+  }
+
   log << "Reading Themisto alignments\n";
   std::vector<cxxio::In> infiles(args.value<std::vector<std::string>>('r').size());
   std::vector<std::istream*> infile_ptrs(infiles.size());
@@ -86,10 +137,41 @@ int main(int argc, char* argv[]) {
     infile_ptrs.push_back(&std::cin);
   }
 
-  uint32_t n_refs = args.value<uint32_t>("n-refs");
+  uint32_t n_kept = (subset ? subset->n_kept() : n_refs);
+  if (subset) {
+    log << "Keeping " + std::to_string(n_kept) + " of " + std::to_string(n_refs) + " target sequences\n";
+  }
 
   if (!args.value<bool>("merge")) {
-    const telescope::ThemistoAlignment &alignments = telescope::read::Themisto(args.value<bm::set_operation>("mode"), n_refs, infile_ptrs);
+    // Inputs from cin can't be fingerprinted so they are never cached.
+    // The cache does not store the lanes of concatenated files.
+    telescope::ThemistoAlignment alignments;
+    std::unique_ptr<telescope::AlignmentCache> cache;
+    std::string cache_key;
+    bool cache_hit = false;
+    if (!args.value<std::string>("cache-dir").empty() && !args.value<bool>("cin") && args.value<bm::set_operation>("mode") != telescope::set_concatenate) {
+      try {
+	cache.reset(new telescope::AlignmentCache(args.value<std::string>("cache-dir"), args.value<size_t>("cache-size")*1000000));
+	cache_key = cache->key(args.value<std::vector<std::string>>('r'), n_refs, args.value<bm::set_operation>("mode"), args.value<bool>("read-to-ref"), subset.get());
+	cache_hit = cache->load(cache_key, n_kept, &alignments);
+      } catch (std::exception &e) {
+	log << "Could not use the cache: " + std::string(e.what()) + '\n';
+	cache.reset();
+      }
+      if (cache_hit) {
+	log << "Loaded the collapsed alignment from the cache\n";
+      }
+    }
+    if (!cache_hit) {
+      alignments = telescope::read::Themisto(args.value<bm::set_operation>("mode"), n_refs, infile_ptrs, args.value<telescope::collapse_engine>("collapse"), args.value<size_t>("threads"), args.value<bool>("read-to-ref"), subset.get());
+      if (cache) {
+	try {
+	  cache->store(cache_key, alignments);
+	} catch (std::exception &e) {
+	  log << "Could not store the alignment in the cache: " + std::string(e.what()) + '\n';
+	}
+      }
+    }
 
     log << "Writing Kallisto format alignments\n";
     telescope::KallistoRunInfo run_info(alignments);
@@ -105,24 +187,62 @@ int main(int argc, char* argv[]) {
     cxxio::Out tsv_file(args.value<std::string>('o') + "/pseudoalignments.tsv");
     telescope::write::ThemistoToKallisto(alignments, &ec_file.stream(), &tsv_file.stream());
 
-    log << "Writing read assignments to equivalence classes\n";
-    cxxio::Out read_to_ref_file(args.value<std::string>('o') + "/read-to-ref.txt");
-    telescope::write::ThemistoReadAssignments(alignments, &read_to_ref_file.stream());
+    if (args.value<bool>("read-to-ref")) {
+      log << "Writing read assignments to equivalence classes\n";
+      cxxio::Out read_to_ref_file(args.value<std::string>('o') + "/read-to-ref.txt");
+      telescope::write::ThemistoReadAssignments(alignments, &read_to_ref_file.stream());
+    }
+
+    if (args.value<bool>("write-index")) {
+      log << "Writing binary equivalence class index\n";
+      cxxio::Out index_file(args.value<std::string>('o') + "/pseudoalignments.idx");
+      telescope::write::ECIndexFile(alignments, &index_file.stream());
+    }
+
+    if (subset) {
+      log << "Writing the original ids of the kept target sequences\n";
+      cxxio::Out targets_file(args.value<std::string>('o') + "/targets.txt");
+      telescope::write::TargetSubsetIds(*subset, &targets_file.stream());
+    }
 
     cxxio::Out run_info_file(args.value<std::string>('o') + "/run_info.json");
     telescope::write::KallistoInfoFile(run_info, 4, &run_info_file.stream());
   } else {
-    const telescope::ThemistoAlignment &alignments = telescope::read::ThemistoPlain(args.value<bm::set_operation>("mode"), n_refs, infile_ptrs);
+    std::vector<double> file_seconds;
+    const telescope::ThemistoAlignment &alignments = telescope::read::ThemistoPlain(args.value<bm::set_operation>("mode"), n_refs, infile_ptrs, args.value<size_t>("threads"), &file_seconds, subset.get());
+    for (size_t i = 0; i < file_seconds.size(); ++i) {
+      const std::string &path = (i < args.value<std::vector<std::string>>('r').size() ? args.value<std::vector<std::string>>('r').at(i) : "cin");
+      log << "Read " + path + " in " + std::to_string(file_seconds[i]) + "s\n";
+    }
 
     log << "Writing Themisto format alignment\n";
-    cxxio::Out alignment_file(args.value<std::string>('o') + ".aln");
     if (args.value<bool>("write-compact")) {
-      alignment_writer::Pack(alignments.get_configs(), n_refs, alignments.n_reads(), &alignment_file.stream());
+      cxxio::Out alignment_file(args.value<std::string>('o') + ".aln");
+      alignment_writer::Pack(alignments.get_configs(), n_kept, alignments.n_reads(), &alignment_file.stream());
     } else {
-      throw std::runtime_error("Writing plaintext Themisto alignments is currently unsupported, use alignment-writer to decompress the files.");
+      const std::string &compression = args.value<std::string>("compress-output");
+      if (compression == "none") {
+	cxxio::Out plaintext_file(args.value<std::string>('o') + ".txt");
+	telescope::write::ThemistoPlaintext(alignments, &plaintext_file.stream(), args.value<size_t>("threads"));
+      } else {
+	// parse_args checked that the compression is gz or xz.
+	bxz::ofstream plaintext_file(args.value<std::string>('o') + ".txt." + compression, (compression == "gz" ? bxz::z : bxz::lzma), 6);
+	telescope::write::ThemistoPlaintext(alignments, &plaintext_file, args.value<size_t>("threads"));
+      }
+    }
+
+    if (subset) {
+      cxxio::Out targets_file(args.value<std::string>('o') + ".targets.txt");
+      telescope::write::TargetSubsetIds(*subset, &targets_file.stream());
     }
   }
 
+  if (!args.value<std::string>("metrics-json").empty()) {
+    log << "Writing metrics\n";
+    cxxio::Out metrics_file(args.value<std::string>("metrics-json"));
+    telescope::Metrics::global().write_json(4, &metrics_file.stream());
+  }
+
   log << "Done\n";
   log.flush();
 
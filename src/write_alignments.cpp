@@ -19,8 +19,108 @@
 #include "telescope.hpp"
 
 #include <string>
+#include <vector>
+#include <thread>
+#include <charconv>
+#include <cstring>
+#include <exception>
+#include <algorithm>
 
 namespace telescope {
+class BufferedWriter {
+  // telescope::BufferedWriter
+  //
+  // Formats output into a large buffer and writes full buffers to
+  // `out` on a background thread, so that formatting the next buffer
+  // overlaps with writing (and compressing) the previous one.
+  //
+private:
+  std::ostream *out;
+  size_t buffer_size;
+  std::vector<char> buffer;
+  std::vector<char> writing;
+  std::thread writer;
+  bool write_failed;
+
+  void wait() {
+    if (this->writer.joinable()) {
+      this->writer.join();
+    }
+    if (this->write_failed) {
+      throw std::runtime_error("Error writing the output file.");
+    }
+  }
+
+public:
+  BufferedWriter(std::ostream *_out, const size_t _buffer_size = 4194304) {
+    this->out = _out;
+    this->buffer_size = _buffer_size;
+    this->buffer.reserve(_buffer_size + 64);
+    this->write_failed = false;
+  }
+
+  ~BufferedWriter() {
+    if (this->writer.joinable()) {
+      this->writer.join();
+    }
+  }
+
+  void put(const char c) {
+    this->buffer.push_back(c);
+  }
+
+  void put(const char *str, const size_t len) {
+    this->buffer.insert(this->buffer.end(), str, str + len);
+  }
+
+  void put(const uint64_t val) {
+    char str[20];
+    char *end = std::to_chars(str, str + 20, val).ptr;
+    this->buffer.insert(this->buffer.end(), str, end);
+  }
+
+  // Hand the buffer to the writer thread if it is full.
+  void write_if_full() {
+    if (this->buffer.size() >= this->buffer_size) {
+      this->wait();
+      this->writing.swap(this->buffer);
+      this->buffer.clear();
+      this->writer = std::thread([this]() {
+	this->out->write(this->writing.data(), this->writing.size());
+	this->write_failed = !this->out->good();
+      });
+    }
+  }
+
+  // Write everything and flush `out`.
+  void flush() {
+    this->wait();
+    this->out->write(this->buffer.data(), this->buffer.size());
+    this->buffer.clear();
+    this->out->flush();
+    if (!this->out->good()) {
+      throw std::runtime_error("Error writing the output file.");
+    }
+  }
+};
+
+void FormatTargets(const TargetIds &targets, const char delim, std::vector<char> *formatted) {
+  // telescope::FormatTargets
+  //
+  // Formats the target sequence ids in `targets` separated by `delim`
+  // into `formatted`.
+  //
+  formatted->clear();
+  char str[20];
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (i > 0) {
+      formatted->push_back(delim);
+    }
+    char *end = std::to_chars(str, str + 20, targets[i]).ptr;
+    formatted->insert(formatted->end(), str, end);
+  }
+}
+
 namespace write {
 void ThemistoToKallisto(const ThemistoAlignment &aln, std::ostream* ec_file, std::ostream* tsv_file) {
   // telescope::write::ThemistoToKallisto
@@ -32,48 +132,209 @@ void ThemistoToKallisto(const ThemistoAlignment &aln, std::ostream* ec_file, std
   //   `ec_file`: Pointer to the file that will store the equivalence class configurations.
   //   `tsv_file`: Pointer to the file that will contain the observation counts of each equivalence class.
   //
-  uint32_t ec_id = 0;
-  for (uint32_t i = 0; i < aln.n_ecs(); ++i) {
-    std::string aligneds("");
-    for (uint32_t j = 0; j < aln.n_targets(); ++j) {
-      if (aln(i, j)) {
-	aligneds += std::to_string(j);
-	aligneds += ',';
-      }
-    }
-    aligneds.pop_back();
-    *ec_file << ec_id << '\t' << aligneds << '\n';
-    *tsv_file << ec_id << '\t' << aln.reads_in_ec(i) << '\n';
-    ++ec_id;
+  ScopedPhase phase("write_kallisto");
+  BufferedWriter ec_out(ec_file);
+  BufferedWriter tsv_out(tsv_file);
+  std::vector<char> aligneds;
+  for (size_t ec_id = 0; ec_id < aln.n_ecs(); ++ec_id) {
+    FormatTargets(aln.ec_target_ids(ec_id), ',', &aligneds);
+    ec_out.put((uint64_t)ec_id);
+    ec_out.put('\t');
+    ec_out.put(aligneds.data(), aligneds.size());
+    ec_out.put('\n');
+    ec_out.write_if_full();
+
+    tsv_out.put((uint64_t)ec_id);
+    tsv_out.put('\t');
+    tsv_out.put((uint64_t)aln.reads_in_ec(ec_id));
+    tsv_out.put('\n');
+    tsv_out.write_if_full();
   }
-  ec_file->flush();
-  tsv_file->flush();
+  ec_out.flush();
+  tsv_out.flush();
 }
 
 void ThemistoReadAssignments(const ThemistoAlignment &aln, std::ostream* out) {
   // telescope::write::ThemistoReadAssignments
   //
   // Writes the alignment of each read against the reference sequences.
+  // Reads in an alignment concatenated from several files are written as
+  // <file>:<read id in the file>.
   //
   // Input:
   //   `aln`: The pseudoalignment to write.
   //   `out`: Pointer to the output file stream.
   //
-  for (uint32_t i = 0; i < aln.n_ecs(); ++i) {
-    for (uint32_t j = 0; j < aln.reads_assigned_to_ec(i).size(); ++j) {
-      *out << aln.reads_assigned_to_ec(i)[j] << ' ';
-      std::string aligned_to("");
-      for (uint32_t k = 0; k < aln.n_targets(); ++k) {
-	if (aln(i, k)) {
-	  aligned_to += std::to_string(k);
-	  aligned_to += ' ';
+  ScopedPhase phase("write_read_assignments");
+  BufferedWriter read_out(out);
+  std::vector<char> aligned_to;
+  const std::vector<size_t> &lane_offsets = aln.get_lane_offsets();
+  for (size_t ec_id = 0; ec_id < aln.n_ecs(); ++ec_id) {
+    // Format the targets once per equivalence class.
+    FormatTargets(aln.ec_target_ids(ec_id), ' ', &aligned_to);
+    aligned_to.push_back('\n');
+    const ReadIds &reads = aln.reads_assigned_to_ec(ec_id);
+    for (size_t j = 0; j < reads.size(); ++j) {
+      if (lane_offsets.empty()) {
+	read_out.put((uint64_t)reads[j]);
+      } else {
+	// Concatenated files: write the read as <file>:<read id in the file>.
+	size_t lane = std::upper_bound(lane_offsets.begin(), lane_offsets.end(), (size_t)reads[j]) - lane_offsets.begin() - 1;
+	read_out.put((uint64_t)lane);
+	read_out.put(':');
+	read_out.put((uint64_t)(reads[j] - lane_offsets[lane]));
+      }
+      read_out.put(' ');
+      read_out.put(aligned_to.data(), aligned_to.size());
+      read_out.write_if_full();
+    }
+  }
+  read_out.flush();
+}
+
+void ThemistoPlaintext(const ThemistoAlignment &aln, std::ostream* out, size_t n_threads) {
+  // telescope::write::ThemistoPlaintext
+  //
+  // Writes the alignment contained in `aln` in the plaintext Themisto
+  // format: one line per read containing the read id followed by the
+  // target sequence ids the read aligned against.
+  //
+  // The reads are split into ranges that are formatted in parallel into
+  // separate buffers. The buffers are written in order on a background
+  // thread while the next ranges are formatted.
+  //
+  // Input:
+  //   `aln`: The pseudoalignment to write (not collapsed).
+  //   `out`: Pointer to the output file stream.
+  //   `n_threads`: Number of threads to use in formatting the output.
+  //
+  ScopedPhase phase("write_plaintext");
+  n_threads = std::max((size_t)1, n_threads);
+  const bm::bvector<> &ec_configs = aln.get_configs();
+  size_t n_reads = aln.n_reads();
+  size_t n_refs = aln.n_targets();
+  size_t range_size = 65536;
+
+  // Format into `buffers[round % 2]` while `buffers[(round + 1) % 2]` is written.
+  std::vector<std::vector<char>> buffers[2] = { std::vector<std::vector<char>>(n_threads), std::vector<std::vector<char>>(n_threads) };
+  std::thread writer;
+  bool write_failed = false;
+
+  size_t round = 0;
+  for (size_t first_read = 0; first_read < n_reads; first_read += n_threads*range_size) {
+    std::vector<std::vector<char>> &formatted = buffers[round % 2];
+
+#pragma omp parallel for schedule(static, 1) num_threads(n_threads)
+    for (size_t i = 0; i < n_threads; ++i) {
+      size_t range_start = std::min(first_read + i*range_size, n_reads);
+      size_t range_end = std::min(range_start + range_size, n_reads);
+      std::vector<char> &buffer = formatted[i];
+      buffer.clear();
+
+      char str[20];
+      size_t next_read = range_start;
+      auto put_read_id = [&](const size_t read_id) {
+	char *end = std::to_chars(str, str + 20, read_id).ptr;
+	buffer.insert(buffer.end(), str, end);
+      };
+      ForEachRow(ec_configs, n_refs, range_start, range_end, [&](const size_t read_id, const TargetIds &targets) {
+	// Reads that did not align only have their id on the line.
+	for (; next_read < read_id; ++next_read) {
+	  put_read_id(next_read);
+	  buffer.push_back('\n');
+	}
+	put_read_id(read_id);
+	for (size_t j = 0; j < targets.size(); ++j) {
+	  buffer.push_back(' ');
+	  char *end = std::to_chars(str, str + 20, targets[j]).ptr;
+	  buffer.insert(buffer.end(), str, end);
 	}
+	buffer.push_back('\n');
+	++next_read;
+      });
+      for (; next_read < range_end; ++next_read) {
+	put_read_id(next_read);
+	buffer.push_back('\n');
       }
-      aligned_to.pop_back();
-      *out << aligned_to << '\n';
     }
+
+    if (writer.joinable()) {
+      writer.join();
+    }
+    const std::vector<std::vector<char>> *to_write = &formatted;
+    writer = std::thread([out, to_write, &write_failed]() {
+      for (size_t i = 0; i < to_write->size() && !write_failed; ++i) {
+	out->write((*to_write)[i].data(), (*to_write)[i].size());
+	write_failed = !out->good();
+      }
+    });
+    ++round;
   }
+  if (writer.joinable()) {
+    writer.join();
+  }
+
   out->flush();
+  if (write_failed || !out->good()) {
+    throw std::runtime_error("Error writing the output file.");
+  }
+}
+
+void ECIndexFile(const ThemistoAlignment &aln, std::ostream* out) {
+  // telescope::write::ECIndexFile
+  //
+  // Writes the equivalence classes, their counts, and the reads assigned
+  // to them as a binary index that can be memory-mapped with
+  // telescope::read::ECIndexFile (format described in `ECIndex.hpp`).
+  //
+  // Input:
+  //   `aln`: The collapsed pseudoalignment to write.
+  //   `out`: Pointer to the output file stream (opened in binary mode).
+  //
+  ScopedPhase phase("write_ec_index");
+  size_t n_ecs = aln.n_ecs();
+  const RowIndex &ec_rows = aln.get_ec_targets();
+  std::vector<uint64_t> ec_target_offsets(ec_rows.get_offsets().begin(), ec_rows.get_offsets().end());
+  const std::vector<uint32_t> &ec_targets = ec_rows.get_targets();
+
+  std::vector<uint32_t> ec_counts(n_ecs);
+  for (size_t i = 0; i < n_ecs; ++i) {
+    ec_counts[i] = aln.reads_in_ec(i);
+  }
+
+  // Reads are only available if they were stored when collapsing.
+  const std::vector<uint32_t> &read_ids = aln.get_aligned_reads();
+  std::vector<uint64_t> read_offsets(n_ecs + 1, 0);
+  if (!aln.get_aligned_reads_offsets().empty()) {
+    read_offsets.assign(aln.get_aligned_reads_offsets().begin(), aln.get_aligned_reads_offsets().end());
+  }
+
+  ECIndexHeader header;
+  std::memcpy(header.magic, ec_index_magic, 8);
+  header.version = ec_index_version;
+  header.byte_order = ec_index_byte_order;
+  header.n_targets = aln.n_targets();
+  header.n_reads = aln.n_reads();
+  header.n_ecs = n_ecs;
+  header.n_ec_targets = ec_targets.size();
+  header.n_aligned_reads = read_ids.size();
+
+  // Write each section padded to a multiple of 8 bytes.
+  const char padding[8] = { 0 };
+  auto write_section = [&](const void *data, const size_t n_bytes) {
+    out->write(static_cast<const char*>(data), n_bytes);
+    out->write(padding, (8 - n_bytes % 8) % 8);
+  };
+  write_section(&header, sizeof(ECIndexHeader));
+  write_section(ec_target_offsets.data(), ec_target_offsets.size()*sizeof(uint64_t));
+  write_section(ec_targets.data(), ec_targets.size()*sizeof(uint32_t));
+  write_section(ec_counts.data(), ec_counts.size()*sizeof(uint32_t));
+  write_section(read_offsets.data(), read_offsets.size()*sizeof(uint64_t));
+  write_section(read_ids.data(), read_ids.size()*sizeof(uint32_t));
+  out->flush();
+  if (!out->good()) {
+    throw std::runtime_error("Error writing the output file.");
+  }
 }
 
 void KallistoInfoFile(const KallistoRunInfo &run_info, const uint8_t indent_len, std::ostream *out) {
@@ -86,6 +347,7 @@ void KallistoInfoFile(const KallistoRunInfo &run_info, const uint8_t indent_len,
   //   `indent_len`: Indent length in the written json file.
   //   `out`: Pointer to a file stream to write into.
   //
+  ScopedPhase phase("write_run_info");
   std::string indent;
   for (uint8_t i = 0; i < indent_len; ++i) {
     indent += " ";
@@ -105,5 +367,21 @@ void KallistoInfoFile(const KallistoRunInfo &run_info, const uint8_t indent_len,
   *out << "}" << '\n';
   out->flush();
 }
+
+void TargetSubsetIds(const TargetSubset &subset, std::ostream *out) {
+  // telescope::write::TargetSubsetIds
+  //
+  // Writes the original id of each target sequence kept in `subset`,
+  // one per line in the order of their ids in the subset.
+  //
+  // Input:
+  //   `subset`: The kept target sequences.
+  //   `out`: Pointer to a file stream to write into.
+  //
+  for (size_t i = 0; i < subset.n_kept(); ++i) {
+    *out << subset.original_id(i) << '\n';
+  }
+  out->flush();
+}
 } // namespace write
 } // namespace telescope
@@ -0,0 +1,160 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#ifndef TELESCOPE_UNITTEST_ALIGNMENTS_HPP
+#define TELESCOPE_UNITTEST_ALIGNMENTS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <random>
+#include <sstream>
+#include <algorithm>
+
+#include "gtest/gtest.h"
+
+#include "bm64.h"
+#include "bmserial.h"
+#include "pack.hpp"
+
+#include "telescope.hpp"
+
+namespace telescope {
+namespace unittest {
+// Random alignment of `n_reads` reads against `n_refs` targets where
+// the aligned reads hit either one random target or one of
+// `n_patterns` random patterns of 1...max_hits targets.
+inline bm::bvector<> RandomAlignment(const size_t n_reads, const size_t n_refs, const uint32_t seed, const size_t n_patterns = 20, const size_t max_hits = 6) {
+  std::mt19937_64 gen(seed);
+  std::uniform_int_distribution<size_t> target(0, n_refs - 1);
+  std::uniform_int_distribution<size_t> pattern(0, n_patterns - 1);
+  std::uniform_int_distribution<size_t> pattern_size(1, max_hits);
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+
+  std::vector<std::vector<size_t>> patterns(n_patterns);
+  for (size_t i = 0; i < n_patterns; ++i) {
+    size_t size = pattern_size(gen);
+    for (size_t j = 0; j < size; ++j) {
+      patterns[i].emplace_back(target(gen));
+    }
+  }
+
+  bm::bvector<> bits(bm::BM_GAP);
+  bm::bvector<>::bulk_insert_iterator it(bits);
+  for (size_t i = 0; i < n_reads; ++i) {
+    double draw = unif(gen);
+    if (draw < 0.2) {
+      continue; // Unaligned
+    } else if (draw < 0.5) {
+      it = i*n_refs + target(gen);
+    } else {
+      for (const size_t hit : patterns[pattern(gen)]) {
+	it = i*n_refs + hit;
+      }
+    }
+  }
+  it.flush();
+  bits.resize(n_reads*n_refs);
+  return bits;
+}
+
+// Format `bits` in the plaintext Themisto format.
+inline std::string ToPlaintext(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs) {
+  bm::bvector<> copy(bits);
+  ThemistoAlignment aln(n_refs, n_reads, copy);
+  std::ostringstream out;
+  write::ThemistoPlaintext(aln, &out);
+  return out.str();
+}
+
+// Format `bits` in the alignment-writer format with `bits_per_chunk`
+// bits of the alignment in each serialized chunk, so a read can be
+// split between two chunks. The header line is taken from
+// alignment_writer::Pack so that it matches the library version.
+inline std::string ToCompactChunks(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs, const size_t bits_per_chunk) {
+  std::ostringstream packed;
+  alignment_writer::Pack(bm::bvector<>(n_reads*n_refs), n_refs, n_reads, &packed);
+  std::string header = packed.str();
+  header = header.substr(0, header.find('\n') + 1);
+
+  std::ostringstream out;
+  out << header;
+  size_t n_bits = n_reads*n_refs;
+  for (size_t first = 0; first < n_bits; first += bits_per_chunk) {
+    size_t last = std::min(first + bits_per_chunk, n_bits);
+    bm::bvector<> chunk(bm::BM_GAP);
+    chunk.copy_range(bits, first, last - 1);
+    chunk.optimize();
+    bm::serializer<bm::bvector<>> serializer;
+    bm::serializer<bm::bvector<>>::buffer buffer;
+    serializer.serialize(chunk, buffer);
+    out << buffer.size() << '\n';
+    out.write(reinterpret_cast<const char*>(buffer.buf()), buffer.size());
+  }
+  return out.str();
+}
+
+// Format `bits` in the alignment-writer format with `reads_per_chunk`
+// reads in each serialized chunk.
+inline std::string ToCompact(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs, const size_t reads_per_chunk) {
+  return ToCompactChunks(bits, n_reads, n_refs, reads_per_chunk*n_refs);
+}
+
+// Check that the collapsed alignments `got` and `expected` have the
+// same equivalence classes, counts, and read assignments.
+inline void ExpectSameCollapse(const ThemistoAlignment &got, const ThemistoAlignment &expected) {
+  EXPECT_EQ(got.n_reads(), expected.n_reads());
+  EXPECT_EQ(got.n_unique_reads(), expected.n_unique_reads());
+  ASSERT_EQ(got.n_ecs(), expected.n_ecs());
+  for (size_t i = 0; i < expected.n_ecs(); ++i) {
+    const TargetIds &got_targets = got.ec_target_ids(i);
+    const TargetIds &expected_targets = expected.ec_target_ids(i);
+    EXPECT_TRUE(std::equal(got_targets.begin(), got_targets.end(), expected_targets.begin(), expected_targets.end())) << "ec " << i;
+    EXPECT_EQ(got.reads_in_ec(i), expected.reads_in_ec(i)) << "ec " << i;
+  }
+  EXPECT_EQ(got.get_aligned_reads(), expected.get_aligned_reads());
+  EXPECT_EQ(got.get_aligned_reads_offsets(), expected.get_aligned_reads_offsets());
+}
+
+// Directory under the system temporary directory that is removed
+// with its contents when the object goes out of scope.
+class TempDir {
+private:
+  std::string path;
+
+public:
+  TempDir() {
+    const char *tmp = std::getenv("TMPDIR");
+    std::string pattern = std::string(tmp == nullptr ? "/tmp" : tmp) + "/telescope_unittest_XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    if (mkdtemp(name.data()) == nullptr) {
+      throw std::runtime_error("Could not create a temporary directory.");
+    }
+    this->path = name.data();
+  }
+  ~TempDir() { std::system(("rm -rf '" + this->path + "'").c_str()); }
+
+  const std::string &str() const { return this->path; }
+};
+}
+}
+
+#endif
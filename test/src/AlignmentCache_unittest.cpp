@@ -0,0 +1,147 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "gtest/gtest.h"
+
+#include "unittest_alignments.hpp"
+
+namespace telescope {
+namespace unittest {
+class AlignmentCacheTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    this->input_path = this->dir.str() + "/input.txt";
+    this->cache_dir = this->dir.str() + "/cache";
+    this->write_input(RandomAlignment(this->n_reads, this->n_refs, 3));
+  }
+
+  void write_input(const bm::bvector<> &bits) {
+    std::ofstream out(this->input_path);
+    out << ToPlaintext(bits, this->n_reads, this->n_refs);
+  }
+
+  ThemistoAlignment convert() const {
+    std::ifstream in(this->input_path);
+    std::vector<std::istream*> streams = { &in };
+    return read::Themisto(bm::set_AND, this->n_refs, streams);
+  }
+
+  std::string entry_path(const std::string &key) const { return this->cache_dir + "/" + key + ".idx"; }
+
+  bool exists(const std::string &path) const { return access(path.c_str(), F_OK) == 0; }
+
+  size_t n_reads = 1000;
+  size_t n_refs = 30;
+  TempDir dir;
+  std::string input_path;
+  std::string cache_dir;
+};
+
+TEST_F(AlignmentCacheTest, MissThenHit) {
+  AlignmentCache cache(this->cache_dir, 100000000);
+  const std::string &key = cache.key({ this->input_path }, this->n_refs, bm::set_AND, true);
+  ThemistoAlignment loaded;
+  EXPECT_FALSE(cache.load(key, this->n_refs, &loaded));
+
+  const ThemistoAlignment &expected = this->convert();
+  cache.store(key, expected);
+  EXPECT_TRUE(this->exists(this->entry_path(key)));
+  ASSERT_TRUE(cache.load(key, this->n_refs, &loaded));
+  ExpectSameCollapse(loaded, expected);
+}
+
+TEST_F(AlignmentCacheTest, KeyDependsOnSettingsAndInput) {
+  AlignmentCache cache(this->cache_dir, 100000000);
+  const std::string &key = cache.key({ this->input_path }, this->n_refs, bm::set_AND, true);
+  EXPECT_EQ(key, cache.key({ this->input_path }, this->n_refs, bm::set_AND, true));
+  EXPECT_NE(key, cache.key({ this->input_path }, this->n_refs, bm::set_OR, true));
+  EXPECT_NE(key, cache.key({ this->input_path }, this->n_refs, bm::set_AND, false));
+  EXPECT_NE(key, cache.key({ this->input_path }, this->n_refs + 1, bm::set_AND, true));
+  this->write_input(RandomAlignment(this->n_reads, this->n_refs, 4));
+  EXPECT_NE(key, cache.key({ this->input_path }, this->n_refs, bm::set_AND, true));
+}
+
+TEST_F(AlignmentCacheTest, WrongNumberOfTargetsIsMiss) {
+  AlignmentCache cache(this->cache_dir, 100000000);
+  const std::string &key = cache.key({ this->input_path }, this->n_refs, bm::set_AND, true);
+  cache.store(key, this->convert());
+  ThemistoAlignment loaded;
+  EXPECT_FALSE(cache.load(key, this->n_refs + 1, &loaded));
+}
+
+TEST_F(AlignmentCacheTest, CorruptEntryIsMiss) {
+  AlignmentCache cache(this->cache_dir, 100000000);
+  const std::string &key = cache.key({ this->input_path }, this->n_refs, bm::set_AND, true);
+  cache.store(key, this->convert());
+
+  std::vector<char> bytes;
+  {
+    std::ifstream in(this->entry_path(key), std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  uint64_t offset = 50000000;
+  std::memcpy(bytes.data() + sizeof(ECIndexHeader) + sizeof(uint64_t), &offset, sizeof(uint64_t));
+  {
+    std::ofstream out(this->entry_path(key), std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size());
+  }
+  ThemistoAlignment loaded;
+  EXPECT_FALSE(cache.load(key, this->n_refs, &loaded));
+}
+
+TEST_F(AlignmentCacheTest, EvictsLeastRecentlyUsed) {
+  const ThemistoAlignment &aln = this->convert();
+  std::string first_key = std::string(32, 'a');
+  std::string second_key = std::string(32, 'b');
+  std::string third_key = std::string(32, 'c');
+
+  // Measure the size of one entry to size the cache for two entries.
+  size_t entry_size;
+  {
+    AlignmentCache cache(this->cache_dir, 100000000);
+    cache.store(first_key, aln);
+    struct stat st;
+    ASSERT_EQ(stat(this->entry_path(first_key).c_str(), &st), 0);
+    entry_size = st.st_size;
+  }
+  AlignmentCache cache(this->cache_dir, 2*entry_size);
+  cache.store(second_key, aln);
+  EXPECT_TRUE(this->exists(this->entry_path(first_key)));
+  EXPECT_TRUE(this->exists(this->entry_path(second_key)));
+
+  // Loading the first entry marks it as used, so the second is evicted.
+  usleep(10000);
+  ThemistoAlignment loaded;
+  EXPECT_TRUE(cache.load(first_key, this->n_refs, &loaded));
+  usleep(10000);
+  cache.store(third_key, aln);
+  EXPECT_TRUE(this->exists(this->entry_path(first_key)));
+  EXPECT_FALSE(this->exists(this->entry_path(second_key)));
+  EXPECT_TRUE(this->exists(this->entry_path(third_key)));
+}
+}
+}
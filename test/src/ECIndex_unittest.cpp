@@ -0,0 +1,133 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include "gtest/gtest.h"
+
+#include "unittest_alignments.hpp"
+
+namespace telescope {
+namespace unittest {
+class ECIndexTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    bm::bvector<> bits = RandomAlignment(this->n_reads, this->n_refs, 9);
+    this->aln = ThemistoAlignment(this->n_refs, this->n_reads, bits);
+    this->aln.collapse();
+    this->path = this->dir.str() + "/pseudoalignments.idx";
+    std::ofstream out(this->path, std::ios::binary);
+    write::ECIndexFile(this->aln, &out);
+  }
+
+  std::vector<char> read_bytes() const {
+    std::ifstream in(this->path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+
+  void write_bytes(const std::vector<char> &bytes) const {
+    std::ofstream out(this->path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size());
+  }
+
+  // Byte offsets of the sections in the index file.
+  size_t ec_target_offsets_start() const { return sizeof(ECIndexHeader); }
+  size_t ec_targets_start() const { return this->ec_target_offsets_start() + ECIndexSectionSize<uint64_t>(this->aln.n_ecs() + 1); }
+
+  size_t n_reads = 2000;
+  size_t n_refs = 60;
+  ThemistoAlignment aln;
+  TempDir dir;
+  std::string path;
+};
+
+TEST_F(ECIndexTest, RoundTrip) {
+  const ECIndex &index = read::ECIndexFile(this->path);
+  EXPECT_EQ(index.n_targets(), this->n_refs);
+  EXPECT_EQ(index.n_reads(), this->n_reads);
+  ASSERT_EQ(index.n_ecs(), this->aln.n_ecs());
+  EXPECT_EQ(index.n_aligned_reads(), this->aln.get_aligned_reads().size());
+  for (size_t i = 0; i < index.n_ecs(); ++i) {
+    const TargetIds &targets = this->aln.ec_target_ids(i);
+    EXPECT_TRUE(std::equal(index.ec_begin(i), index.ec_end(i), targets.begin(), targets.end()));
+    EXPECT_EQ(index.reads_in_ec(i), this->aln.reads_in_ec(i));
+    const ReadIds &got_reads = index.reads_assigned_to_ec(i);
+    const ReadIds &expected_reads = this->aln.reads_assigned_to_ec(i);
+    EXPECT_TRUE(std::equal(got_reads.begin(), got_reads.end(), expected_reads.begin(), expected_reads.end()));
+  }
+}
+
+TEST_F(ECIndexTest, MoveKeepsMapping) {
+  ECIndex index = read::ECIndexFile(this->path);
+  ECIndex moved(std::move(index));
+  EXPECT_EQ(moved.n_ecs(), this->aln.n_ecs());
+  index = std::move(moved);
+  EXPECT_EQ(index.n_ecs(), this->aln.n_ecs());
+  EXPECT_EQ(index.reads_in_ec(0), this->aln.reads_in_ec(0));
+}
+
+TEST_F(ECIndexTest, ThrowsOnMissingFile) {
+  EXPECT_THROW(read::ECIndexFile(this->path + ".missing"), std::runtime_error);
+}
+
+TEST_F(ECIndexTest, ThrowsOnBadMagic) {
+  std::vector<char> bytes = this->read_bytes();
+  bytes[0] = 'X';
+  this->write_bytes(bytes);
+  EXPECT_THROW(read::ECIndexFile(this->path), std::runtime_error);
+}
+
+TEST_F(ECIndexTest, ThrowsOnTruncatedFile) {
+  std::vector<char> bytes = this->read_bytes();
+  bytes.resize(bytes.size() - 8);
+  this->write_bytes(bytes);
+  EXPECT_THROW(read::ECIndexFile(this->path), std::runtime_error);
+}
+
+TEST_F(ECIndexTest, ThrowsOnHugeCount) {
+  std::vector<char> bytes = this->read_bytes();
+  ECIndexHeader header;
+  std::memcpy(&header, bytes.data(), sizeof(ECIndexHeader));
+  header.n_ecs = ((uint64_t)1 << 62);
+  std::memcpy(bytes.data(), &header, sizeof(ECIndexHeader));
+  this->write_bytes(bytes);
+  EXPECT_THROW(read::ECIndexFile(this->path), std::runtime_error);
+}
+
+TEST_F(ECIndexTest, ThrowsOnCorruptOffset) {
+  std::vector<char> bytes = this->read_bytes();
+  uint64_t offset = 50000000;
+  std::memcpy(bytes.data() + this->ec_target_offsets_start() + sizeof(uint64_t), &offset, sizeof(uint64_t));
+  this->write_bytes(bytes);
+  EXPECT_THROW(read::ECIndexFile(this->path), std::runtime_error);
+}
+
+TEST_F(ECIndexTest, ThrowsOnTargetOutOfRange) {
+  std::vector<char> bytes = this->read_bytes();
+  uint32_t target = this->n_refs;
+  std::memcpy(bytes.data() + this->ec_targets_start(), &target, sizeof(uint32_t));
+  this->write_bytes(bytes);
+  EXPECT_THROW(read::ECIndexFile(this->path), std::runtime_error);
+}
+}
+}
@@ -0,0 +1,138 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <memory>
+#include <stdexcept>
+
+#include "gtest/gtest.h"
+
+#include "unittest_alignments.hpp"
+
+namespace telescope {
+namespace unittest {
+ThemistoAlignment CollapseInMemory(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs, const collapse_engine engine, const size_t n_threads) {
+  bm::bvector<> copy(bits);
+  ThemistoAlignment aln(n_refs, n_reads, copy);
+  aln.collapse(engine, n_threads);
+  return aln;
+}
+
+ThemistoAlignment CollapseStream(const std::string &text, const size_t n_refs) {
+  std::istringstream stream(text);
+  std::vector<std::istream*> streams = { &stream };
+  return read::Themisto(bm::set_OR, n_refs, streams, collapse_stream);
+}
+
+ThemistoAlignment CollapseRowIndex(const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs, const size_t n_threads) {
+  ThemistoAlignment aln(n_refs);
+  aln.collapse(RowIndex(bits, n_refs, n_reads), n_threads);
+  return aln;
+}
+
+// The reference sizes select each of the hash table key widths.
+class CollapseEngineTest : public ::testing::TestWithParam<size_t> {
+protected:
+  void SetUp() override {
+    this->n_refs = GetParam();
+    this->bits = RandomAlignment(this->n_reads, this->n_refs, 20230126 + this->n_refs);
+    this->expected = CollapseInMemory(this->bits, this->n_reads, this->n_refs, collapse_hash, 1);
+  }
+
+  size_t n_reads = 5000;
+  size_t n_refs;
+  bm::bvector<> bits;
+  ThemistoAlignment expected;
+};
+
+TEST_P(CollapseEngineTest, HashCreatesClasses) {
+  EXPECT_GT(this->expected.n_ecs(), (size_t)1);
+  EXPECT_GT(this->expected.n_unique_reads(), (size_t)0);
+}
+
+TEST_P(CollapseEngineTest, ParallelHashMatchesHash) {
+  ExpectSameCollapse(CollapseInMemory(this->bits, this->n_reads, this->n_refs, collapse_hash, 4), this->expected);
+}
+
+TEST_P(CollapseEngineTest, SortMatchesHash) {
+  ExpectSameCollapse(CollapseInMemory(this->bits, this->n_reads, this->n_refs, collapse_sort, 1), this->expected);
+}
+
+TEST_P(CollapseEngineTest, ParallelSortMatchesHash) {
+  ExpectSameCollapse(CollapseInMemory(this->bits, this->n_reads, this->n_refs, collapse_sort, 3), this->expected);
+}
+
+TEST_P(CollapseEngineTest, LegacyMatchesHash) {
+  ExpectSameCollapse(CollapseInMemory(this->bits, this->n_reads, this->n_refs, collapse_legacy, 1), this->expected);
+}
+
+TEST_P(CollapseEngineTest, StreamMatchesHash) {
+  ExpectSameCollapse(CollapseStream(ToPlaintext(this->bits, this->n_reads, this->n_refs), this->n_refs), this->expected);
+}
+
+TEST_P(CollapseEngineTest, RowIndexMatchesHash) {
+  ExpectSameCollapse(CollapseRowIndex(this->bits, this->n_reads, this->n_refs, 1), this->expected);
+  ExpectSameCollapse(CollapseRowIndex(this->bits, this->n_reads, this->n_refs, 4), this->expected);
+}
+
+INSTANTIATE_TEST_SUITE_P(KeyWidths, CollapseEngineTest, ::testing::Values(40, 100, 200, 500));
+
+TEST(CollapseTest, ZeroThreadsRunsOnOneThread) {
+  const bm::bvector<> &bits = RandomAlignment(100, 10, 1);
+  const ThemistoAlignment &expected = CollapseInMemory(bits, 100, 10, collapse_hash, 1);
+  ExpectSameCollapse(CollapseInMemory(bits, 100, 10, collapse_sort, 0), expected);
+  ExpectSameCollapse(CollapseInMemory(bits, 100, 10, collapse_hash, 0), expected);
+}
+
+TEST(CollapseTest, KnownClasses) {
+  const std::string text = "0 1 2\n1\n2 2 1\n3 0\n4 1\n5 0\n";
+  const ThemistoAlignment &aln = CollapseStream(text, 3);
+  EXPECT_EQ(aln.n_reads(), (size_t)6);
+  ASSERT_EQ(aln.n_ecs(), (size_t)3);
+  EXPECT_EQ(aln.reads_in_ec(0), (size_t)2); // 1,2
+  EXPECT_EQ(aln.reads_in_ec(1), (size_t)2); // 0
+  EXPECT_EQ(aln.reads_in_ec(2), (size_t)1); // 1
+  EXPECT_EQ(aln.n_unique_reads(), (size_t)3);
+  EXPECT_EQ(aln.get_aligned_reads(), std::vector<uint32_t>({ 0, 2, 3, 5, 4 }));
+  EXPECT_TRUE(aln(0, 1) && aln(0, 2) && aln(1, 0) && aln(2, 1));
+  EXPECT_FALSE(aln(0, 0) || aln(1, 1) || aln(2, 2));
+}
+
+TEST(CollapseTest, InMemoryReleasesMatrix) {
+  const bm::bvector<> &bits = RandomAlignment(100, 10, 2);
+  const ThemistoAlignment &aln = CollapseInMemory(bits, 100, 10, collapse_hash, 1);
+  EXPECT_FALSE(aln.get_configs().any());
+  for (size_t i = 0; i < aln.n_ecs(); ++i) {
+    for (size_t j = 0; j < 10; ++j) {
+      const TargetIds &targets = aln.ec_target_ids(i);
+      EXPECT_EQ((bool)aln(i, j), std::find(targets.begin(), targets.end(), (uint32_t)j) != targets.end());
+    }
+  }
+}
+
+TEST(CollapseTest, GroupedLegacyRejectsCollapseOnGroups) {
+  std::istringstream stream("0 1 2\n1 0\n");
+  std::vector<std::istream*> streams = { &stream };
+  std::vector<uint32_t> group_indicators = { 0, 1, 1 };
+  std::unique_ptr<Alignment> aln;
+  EXPECT_THROW(read::ThemistoGrouped(bm::set_OR, 3, group_indicators, streams, aln, collapse_legacy, 1, true, true), std::runtime_error);
+}
+}
+}
@@ -0,0 +1,322 @@
+// telescope: convert between Themisto and kallisto pseudoalignments
+// Copyright (C) 2019 Tommi Mäklin (tommi@maklin.fi)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+// USA
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+
+#include "gtest/gtest.h"
+
+#include "unittest_alignments.hpp"
+
+namespace telescope {
+namespace unittest {
+// Parse `line` with ParsePlaintextLine and store the read id and targets.
+bool Parse(const std::string &line, size_t *read_id, std::vector<size_t> *targets) {
+  targets->clear();
+  return ParsePlaintextLine(line.data(), line.data() + line.size(), read_id, [targets](const size_t target) { targets->emplace_back(target); });
+}
+
+TEST(ParsePlaintextLineTest, ReadWithTargets) {
+  size_t read_id;
+  std::vector<size_t> targets;
+  EXPECT_TRUE(Parse("12 3 0 7", &read_id, &targets));
+  EXPECT_EQ(read_id, (size_t)12);
+  EXPECT_EQ(targets, std::vector<size_t>({ 3, 0, 7 }));
+}
+
+TEST(ParsePlaintextLineTest, UnalignedRead) {
+  size_t read_id;
+  std::vector<size_t> targets;
+  EXPECT_TRUE(Parse("5", &read_id, &targets));
+  EXPECT_EQ(read_id, (size_t)5);
+  EXPECT_TRUE(targets.empty());
+}
+
+TEST(ParsePlaintextLineTest, RepeatedAndTrailingSpaces) {
+  size_t read_id;
+  std::vector<size_t> targets;
+  EXPECT_TRUE(Parse("5  1   2 ", &read_id, &targets));
+  EXPECT_EQ(read_id, (size_t)5);
+  EXPECT_EQ(targets, std::vector<size_t>({ 1, 2 }));
+  EXPECT_TRUE(Parse("6 ", &read_id, &targets));
+  EXPECT_EQ(read_id, (size_t)6);
+  EXPECT_TRUE(targets.empty());
+}
+
+TEST(ParsePlaintextLineTest, WindowsLineEnding) {
+  size_t read_id;
+  std::vector<size_t> targets;
+  EXPECT_TRUE(Parse("4 9\r", &read_id, &targets));
+  EXPECT_EQ(read_id, (size_t)4);
+  EXPECT_EQ(targets, std::vector<size_t>({ 9 }));
+}
+
+TEST(ParsePlaintextLineTest, LargeIds) {
+  size_t read_id;
+  std::vector<size_t> targets;
+  EXPECT_TRUE(Parse("4294967296 4294967295", &read_id, &targets));
+  EXPECT_EQ(read_id, (size_t)4294967296);
+  EXPECT_EQ(targets, std::vector<size_t>({ 4294967295 }));
+}
+
+TEST(ParsePlaintextLineTest, RejectsMalformedLines) {
+  size_t read_id;
+  std::vector<size_t> targets;
+  EXPECT_FALSE(Parse("", &read_id, &targets));
+  EXPECT_FALSE(Parse(" 1 2", &read_id, &targets));
+  EXPECT_FALSE(Parse("a 1", &read_id, &targets));
+  EXPECT_FALSE(Parse("1 x", &read_id, &targets));
+  EXPECT_FALSE(Parse("1,2", &read_id, &targets));
+  EXPECT_FALSE(Parse("1 2,3", &read_id, &targets));
+  EXPECT_FALSE(Parse("-1 2", &read_id, &targets));
+  EXPECT_FALSE(Parse("1\t2", &read_id, &targets));
+  EXPECT_FALSE(Parse("1 99999999999999999999999", &read_id, &targets));
+}
+
+TEST(ReadPairedAlignmentsTest, PlaintextIntersectionAndUnion) {
+  std::istringstream strand_1("0 1 2\n1 0\n2\n3 2\n");
+  std::istringstream strand_2("0 2\n1 1\n2 0\n3 2 1\n");
+  std::vector<std::istream*> streams = { &strand_1, &strand_2 };
+  bm::bvector<> bits(bm::BM_GAP);
+  size_t n_reads = ReadPairedAlignments(bm::set_AND, 3, streams, &bits);
+  EXPECT_EQ(n_reads, (size_t)4);
+  std::vector<size_t> set_bits;
+  for (bm::bvector<>::enumerator en = bits.first(); en.valid(); ++en) {
+    set_bits.emplace_back(*en);
+  }
+  EXPECT_EQ(set_bits, std::vector<size_t>({ 0*3 + 2, 3*3 + 2 }));
+}
+
+TEST(ReadPairedAlignmentsTest, DifferentNumberOfReadsThrows) {
+  std::istringstream strand_1("0 1\n1 0\n");
+  std::istringstream strand_2("0 1\n");
+  std::vector<std::istream*> streams = { &strand_1, &strand_2 };
+  bm::bvector<> bits(bm::BM_GAP);
+  EXPECT_THROW(ReadPairedAlignments(bm::set_AND, 2, streams, &bits), std::runtime_error);
+}
+
+// Message of the runtime_error thrown when reading `text` with ReadPairedAlignments.
+std::string ReadError(const std::string &text, const size_t n_targets, const TargetSubset *subset) {
+  std::istringstream stream(text);
+  std::vector<std::istream*> streams = { &stream };
+  bm::bvector<> bits(bm::BM_GAP);
+  try {
+    ReadPairedAlignments(bm::set_OR, n_targets, streams, &bits, 1, nullptr, subset);
+  } catch (const std::runtime_error &e) {
+    return e.what();
+  }
+  return "";
+}
+
+TEST(ReadPairedAlignmentsTest, TargetOutOfRangeReportsLine) {
+  EXPECT_EQ(ReadError("0 1\n1 0 3\n2 0\n", 3, nullptr), "Pseudoalignment file has more target sequences than expected on line 2.");
+  EXPECT_EQ(ReadError("0 3\n", 3, nullptr), "Pseudoalignment file has more target sequences than expected on line 1.");
+}
+
+TEST(ReadPairedAlignmentsTest, TargetOutOfRangeWithSubsetReportsLine) {
+  TargetSubset subset(3, { 0, 2 });
+  EXPECT_EQ(ReadError("0 1\n1 3\n2 0\n", 3, &subset), "Pseudoalignment file has more target sequences than expected on line 2.");
+}
+
+TEST(ReadPairedAlignmentsTest, MergesCompactFileChunkByChunk) {
+  const bm::bvector<> &strand_1 = RandomAlignment(1000, 30, 15);
+  const bm::bvector<> &strand_2 = RandomAlignment(1000, 30, 16);
+  for (const bm::set_operation merge_op : { bm::set_AND, bm::set_OR }) {
+    for (const size_t bits_per_chunk : { (size_t)30, (size_t)7*30, (size_t)101, (size_t)1000*30 }) {
+      std::istringstream stream_1(ToPlaintext(strand_1, 1000, 30));
+      std::istringstream stream_2(ToCompactChunks(strand_2, 1000, 30, bits_per_chunk));
+      std::vector<std::istream*> streams = { &stream_1, &stream_2 };
+      bm::bvector<> bits(bm::BM_GAP);
+      EXPECT_EQ(ReadPairedAlignments(merge_op, 30, streams, &bits), (size_t)1000);
+
+      bm::bvector<> expected(strand_1);
+      if (merge_op == bm::set_AND) {
+	expected &= strand_2;
+      } else {
+	expected |= strand_2;
+      }
+      EXPECT_EQ(bits.compare(expected), 0) << "chunk size " << bits_per_chunk;
+    }
+  }
+}
+
+// Reverse the order of the lines in `text`.
+std::string ReverseLines(const std::string &text) {
+  std::vector<std::string> lines;
+  std::istringstream in(text);
+  std::string line;
+  while (std::getline(in, line)) {
+    lines.emplace_back(line);
+  }
+  std::string reversed;
+  for (auto it = lines.rbegin(); it != lines.rend(); ++it) {
+    reversed += *it + '\n';
+  }
+  return reversed;
+}
+
+TEST(ReadPairedAlignmentsTest, ParallelMergeMatchesSequential) {
+  std::vector<bm::bvector<>> strands;
+  for (uint32_t seed = 0; seed < 5; ++seed) {
+    strands.emplace_back(RandomAlignment(2000, 25, 30 + seed, 4, 3));
+  }
+  for (const bm::set_operation merge_op : { bm::set_AND, bm::set_OR }) {
+    bm::bvector<> expected(strands[0]);
+    for (size_t i = 1; i < strands.size(); ++i) {
+      if (merge_op == bm::set_AND) {
+	expected &= strands[i];
+      } else {
+	expected |= strands[i];
+      }
+    }
+    for (const size_t n_threads : { 1, 2, 4 }) {
+      // Mix of sorted and unsorted plaintext and compact files.
+      std::vector<std::istringstream> contents;
+      contents.emplace_back(ToPlaintext(strands[0], 2000, 25));
+      contents.emplace_back(ToCompact(strands[1], 2000, 25, 11));
+      contents.emplace_back(ReverseLines(ToPlaintext(strands[2], 2000, 25)));
+      contents.emplace_back(ToCompactChunks(strands[3], 2000, 25, 333));
+      contents.emplace_back(ToPlaintext(strands[4], 2000, 25));
+      std::vector<std::istream*> streams;
+      for (std::istringstream &stream : contents) {
+	streams.emplace_back(&stream);
+      }
+      bm::bvector<> bits(bm::BM_GAP);
+      EXPECT_EQ(ReadPairedAlignments(merge_op, 25, streams, &bits, n_threads), (size_t)2000);
+      EXPECT_EQ(bits.compare(expected), 0) << "threads " << n_threads;
+    }
+  }
+}
+
+// Collapse `text` with collapse_stream and compare with collapsing `bits` in memory.
+void ExpectStreamMatchesInMemory(const std::string &text, const bm::bvector<> &bits, const size_t n_reads, const size_t n_refs) {
+  std::istringstream stream(text);
+  std::vector<std::istream*> streams = { &stream };
+  const ThemistoAlignment &streamed = read::Themisto(bm::set_OR, n_refs, streams, collapse_stream);
+
+  bm::bvector<> copy(bits);
+  ThemistoAlignment expected(n_refs, n_reads, copy);
+  expected.collapse();
+  ExpectSameCollapse(streamed, expected);
+}
+
+TEST(CompactRowReaderTest, OneReadPerChunk) {
+  bm::bvector<> bits(bm::BM_GAP);
+  bits.set(0*50 + 3);
+  bits.set(1*50 + 7);
+  bits.set(1*50 + 49);
+  bits.set(2*50 + 3);
+  bits.resize(3*50);
+  ExpectStreamMatchesInMemory(ToCompact(bits, 3, 50, 1), bits, 3, 50);
+}
+
+TEST(CompactRowReaderTest, ManyChunks) {
+  const bm::bvector<> &bits = RandomAlignment(3000, 50, 11);
+  for (const size_t reads_per_chunk : { 1, 7, 256, 3000 }) {
+    ExpectStreamMatchesInMemory(ToCompact(bits, 3000, 50, reads_per_chunk), bits, 3000, 50);
+  }
+}
+
+TEST(CompactRowReaderTest, ReadsSplitBetweenChunks) {
+  const bm::bvector<> &bits = RandomAlignment(1000, 50, 12);
+  for (const size_t bits_per_chunk : { 13, 77, 1001 }) {
+    ExpectStreamMatchesInMemory(ToCompactChunks(bits, 1000, 50, bits_per_chunk), bits, 1000, 50);
+  }
+}
+
+TEST(CompactRowReaderTest, EmptyChunks) {
+  bm::bvector<> bits(bm::BM_GAP);
+  bits.set(5*20 + 1);
+  bits.set(90*20 + 2);
+  bits.resize(100*20);
+  ExpectStreamMatchesInMemory(ToCompact(bits, 100, 20, 3), bits, 100, 20);
+}
+
+TEST(CompactRowReaderTest, CountsBytesRead) {
+  Metrics::global().enable();
+  const bm::bvector<> &bits = RandomAlignment(500, 20, 17);
+  for (const std::string &text : { ToCompact(bits, 500, 20, 9), ToPlaintext(bits, 500, 20) }) {
+    uint64_t before = Metrics::global().counter(counter_bytes_read);
+    std::istringstream stream(text);
+    std::vector<std::istream*> streams = { &stream };
+    read::Themisto(bm::set_OR, 20, streams, collapse_stream);
+    EXPECT_EQ(Metrics::global().counter(counter_bytes_read) - before, text.size());
+  }
+}
+
+TEST(CompactRowReaderTest, PairedCompactFiles) {
+  const bm::bvector<> &strand_1 = RandomAlignment(2000, 40, 13);
+  const bm::bvector<> &strand_2 = RandomAlignment(2000, 40, 14);
+  std::istringstream stream_1(ToCompact(strand_1, 2000, 40, 5));
+  std::istringstream stream_2(ToCompact(strand_2, 2000, 40, 9));
+  std::vector<std::istream*> streams = { &stream_1, &stream_2 };
+  const ThemistoAlignment &streamed = read::Themisto(bm::set_OR, 40, streams, collapse_stream);
+
+  bm::bvector<> merged(strand_1);
+  merged |= strand_2;
+  ThemistoAlignment expected(40, 2000, merged);
+  expected.collapse();
+  ExpectSameCollapse(streamed, expected);
+}
+
+// Counts the classes and reads passed to an ECConsumer.
+class CountingConsumer : public ECConsumer {
+public:
+  size_t n_ecs = 0;
+  size_t n_assigned = 0;
+  size_t n_reads = 0;
+
+  void new_ec(const uint32_t, const TargetIds &) override { ++this->n_ecs; }
+  void assign_read(const size_t, const uint32_t) override { ++this->n_assigned; }
+  void finish(const size_t _n_reads) override { this->n_reads = _n_reads; }
+};
+
+TEST(ReadThemistoTest, KallistoAndConsumerKeepLanesAndSubset) {
+  const bm::bvector<> &lane_1 = RandomAlignment(300, 20, 18);
+  const bm::bvector<> &lane_2 = RandomAlignment(200, 20, 19);
+  TargetSubset subset(20, { 1, 3, 5, 7, 11, 13, 17, 19 });
+  for (const collapse_engine engine : { collapse_hash, collapse_stream }) {
+    std::istringstream expected_1(ToPlaintext(lane_1, 300, 20));
+    std::istringstream expected_2(ToPlaintext(lane_2, 200, 20));
+    std::vector<std::istream*> expected_streams = { &expected_1, &expected_2 };
+    const ThemistoAlignment &expected = read::Themisto(set_concatenate, 20, expected_streams, engine, 1, true, &subset);
+    EXPECT_EQ(expected.get_lane_offsets(), std::vector<size_t>({ 0, 300, 500 }));
+
+    std::istringstream kallisto_1(ToPlaintext(lane_1, 300, 20));
+    std::istringstream kallisto_2(ToPlaintext(lane_2, 200, 20));
+    std::vector<std::istream*> kallisto_streams = { &kallisto_1, &kallisto_2 };
+    const KallistoAlignment &kallisto = read::ThemistoToKallisto(set_concatenate, 20, kallisto_streams, engine, 1, true, &subset);
+    EXPECT_EQ(kallisto.n_targets(), subset.n_kept());
+    EXPECT_EQ(kallisto.get_lane_offsets(), expected.get_lane_offsets());
+    ExpectSameCollapse(kallisto, expected);
+
+    std::istringstream consumer_1(ToPlaintext(lane_1, 300, 20));
+    std::istringstream consumer_2(ToPlaintext(lane_2, 200, 20));
+    std::vector<std::istream*> consumer_streams = { &consumer_1, &consumer_2 };
+    CountingConsumer consumer;
+    const ThemistoAlignment &consumed = read::ThemistoToConsumer(set_concatenate, 20, consumer_streams, &consumer, engine, 1, &subset);
+    EXPECT_EQ(consumed.get_lane_offsets(), expected.get_lane_offsets());
+    EXPECT_EQ(consumer.n_ecs, expected.n_ecs());
+    EXPECT_EQ(consumer.n_assigned, expected.get_aligned_reads().size());
+    EXPECT_EQ(consumer.n_reads, (size_t)500);
+  }
+}
+}
+}